@@ -0,0 +1,51 @@
+/*
+Copyright (c) 2012-2017 Matthew Brennan Jones <matthew.brennan.jones@gmail.com>
+A NES emulator in WebAssembly. Based on vNES.
+Licensed under GPLV3 or later
+Hosted at: https://github.com/workhorsy/SaltyNES
+*/
+
+/*
+This class counts heap allocations, so it can be checked that running frames
+does not allocate. The global operator new is only replaced in the
+SaltyNES_alloc_check build, which defines ALLOC_CHECK. Allocations are only
+counted on the emulation thread, so the audio thread and SDL don't count.
+*/
+
+#include "SaltyNES.h"
+
+thread_local bool AllocCounter::_is_counting = false;
+size_t AllocCounter::_count = 0;
+
+#ifdef ALLOC_CHECK
+
+void* operator new(size_t size) {
+	AllocCounter::count_allocation();
+	void* p = malloc(size > 0 ? size : 1);
+	if(!p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+	free(p);
+}
+
+void operator delete[](void* p) noexcept {
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+	free(p);
+}
+
+#endif
@@ -35,6 +35,13 @@ ByteBuffer::ByteBuffer(vector<uint8_t>* content, const int byteOrdering) {
 	}
 }
 
+ByteBuffer::ByteBuffer(const uint8_t* content, size_t size, const int byteOrdering) {
+	this->buf = vector<uint16_t>(content, content + size);
+	this->byteOrder = byteOrdering;
+	curPos = 0;
+	hasBeenErrors = false;
+}
+
 void ByteBuffer::setExpandable(bool exp) {
 	expandable = exp;
 }
@@ -64,6 +64,14 @@ void CPU::init() {
 	// Get Memory Mapper:
 	this->mmap = nes->getMemoryMapper();
 
+	// Create the instruction trace and profile if they were asked for:
+	if(Globals::enableCpuTrace && !trace) {
+		trace = make_shared<CpuTrace>();
+	}
+	if(Globals::cpuProfileFrames > 0 && !profile) {
+		profile = make_shared<CpuProfile>(Globals::cpuProfileFrames);
+	}
+
 	// Reset crash flag:
 	crash = false;
 
@@ -77,7 +85,8 @@ void CPU::init() {
 
 void CPU::stateLoad(ByteBuffer* buf) {
 
-	if(buf->readByte()==1) {
+	int version = buf->readByte();
+	if(version==1 || version==2) {
 		// Version 1
 
 		// Registers:
@@ -92,13 +101,21 @@ void CPU::stateLoad(ByteBuffer* buf) {
 		cyclesToHalt = buf->readInt();
 
 	}
+	if(version==2) {
+		// Version 2
+
+		// The NMI is requested at the end of the frame, so it is
+		// still waiting if the state is saved between frames:
+		irqRequested = buf->readBoolean();
+		irqType = buf->readInt();
+	}
 
 }
 
 void CPU::stateSave(ByteBuffer* buf) {
 
 	// Save info version:
-	buf->putByte(static_cast<uint16_t>(1));
+	buf->putByte(static_cast<uint16_t>(2));
 
 	// Save registers:
 	buf->putInt(getStatus());
@@ -111,6 +128,10 @@ void CPU::stateSave(ByteBuffer* buf) {
 	// Cycles to halt:
 	buf->putInt(cyclesToHalt);
 
+	// Pending interrupt:
+	buf->putBoolean(irqRequested);
+	buf->putInt(irqType);
+
 }
 
 void CPU::reset() {
@@ -185,7 +206,12 @@ void CPU::start() {
 
 void CPU::stop() {
 	stopRunning = true;
+	saveRegisters();
+}
 
+// Copies the registers the CPU runs with to the ones start() takes them from,
+// which are the ones the state is saved from:
+void CPU::saveRegisters() {
 	// Save registers:
 	REG_ACC_NEW 	= REG_ACC;
 	REG_X_NEW 	= REG_X;
@@ -204,14 +230,10 @@ void CPU::stop() {
 	F_SIGN_NEW 	= F_SIGN;
 }
 
-void CPU::emulate_frame() {
-	while (! this->emulate()) {
-		// ..
-	}
-}
-
-// Emulates cpu instructions until screen is drawn.
-bool CPU::emulate() {
+// Emulates one instruction. The tracing and profiling versions are separate
+// instantiations, so the normal loop has no checks for them in it:
+template<bool TRACE, bool PROFILE>
+bool CPU::emulateInstruction() {
 	// NES Memory
 	// (when memory mappers switch ROM banks
 	// this will be written to, no need to
@@ -219,15 +241,13 @@ bool CPU::emulate() {
 	mem = &nes->cpuMem->mem;
 
 	// References to other parts of NES:
-	shared_ptr<MapperDefault> mmap = nes->memMapper;
-	shared_ptr<PPU> 		 ppu  = nes->ppu;
-	shared_ptr<PAPU> 		 papu = nes->papu;
+	MapperDefault* mmap = nes->memMapper.get();
+	PPU* 		   ppu  = nes->ppu.get();
+	PAPU* 		   papu = nes->papu.get();
 
 	bool palEmu = Globals::palEmulation;
 	bool emulateSound = Globals::enableSound;
 
-	//int _counter = 0;
-
 		// Sleep a second if we are paused
 		if(this->nes->_is_paused) {
 //			SDL_Delay(1000000);
@@ -285,36 +305,20 @@ bool CPU::emulate() {
 
 		uint16_t z = mmap->load(REG_PC+1);
 		opinf = CpuInfo::opdata[z];
-		/*
-		stringstream out;
-		if((opinf&0xFF) <= 0xF) {
-			out << _counter << " op: 0x0" << hex << (opinf&0xFF);
-		} else {
-			out << _counter << " op: 0x" << hex << (opinf&0xFF);
+		if(TRACE) {
+			trace->record(
+				REG_PC + 1, z, REG_ACC, REG_X, REG_Y,
+				(F_CARRY)|
+				((F_ZERO==0?1:0)<<1)|
+				(F_INTERRUPT<<2)|
+				(F_DECIMAL<<3)|
+				(F_BRK<<4)|
+				(F_NOTUSED<<5)|
+				(F_OVERFLOW<<6)|
+				(F_SIGN<<7),
+				REG_SP & 0xFF
+			);
 		}
-		// CPU Registers:
-		out << dec;
-		out << "\ta:" << REG_ACC;
-		out << "\tx:" << REG_X;
-		out << "\ty:" << REG_Y;
-		out << "\tst:" << REG_STATUS;
-		out << "\tpc:" << REG_PC;
-		out << "\tsp:" << REG_SP;
-
-		// Status flags:
-		out << " status: ";
-		out << F_CARRY;
-		out << F_ZERO;
-		out << F_INTERRUPT;
-		out << F_DECIMAL;
-		out << F_BRK;
-		out << F_NOTUSED;
-		out << F_OVERFLOW;
-		out << F_SIGN;
-		out << "\n";
-		Logger::write(out.str());
-		Logger::flush();
-		*/
 		cycleCount = (opinf>>24);
 		cycleAdd = 0;
 
@@ -1261,10 +1265,11 @@ bool CPU::emulate() {
 					crash = true;
 					stopRunning = true;
 
-					stringstream out;
-					out << "Game crashed, invalid opcode at address $";
-					out << std::hex << static_cast<int>(opaddr);
-					printf("%s\n", out.str().c_str());
+					printf("Game crashed, invalid opcode at address $%x\n", static_cast<int>(opaddr));
+
+					if(TRACE) {
+						trace->dump(CpuTrace::DEFAULT_FILE);
+					}
 				}
 				break;
 
@@ -1274,6 +1279,10 @@ bool CPU::emulate() {
 
 		// ----------------------------------------------------------------------------------------------------
 
+		if(PROFILE) {
+			profile->countInstruction(z, opinf, opaddr + 1, addr, cycleCount - (opinf>>24), cycleCount);
+		}
+
 		if(palEmu) {
 			++palCnt;
 			if(palCnt==5) {
@@ -1289,11 +1298,48 @@ bool CPU::emulate() {
 			papu->clockFrameCounter(cycleCount);
 		}
 
-		//++_counter;
+		if(TRACE) {
+			trace->cycles += cycleCount;
+		}
+
+		if(PROFILE && did_render) {
+			profile->endFrame();
+		}
 
 	return did_render;
 }
 
+template<bool TRACE, bool PROFILE>
+void CPU::emulateUntilRendered() {
+	while (! this->emulateInstruction<TRACE, PROFILE>()) {
+		// ..
+	}
+}
+
+void CPU::emulate_frame() {
+	if(trace) {
+		if(profile) {
+			emulateUntilRendered<true, true>();
+		} else {
+			emulateUntilRendered<true, false>();
+		}
+	} else {
+		if(profile) {
+			emulateUntilRendered<false, true>();
+		} else {
+			emulateUntilRendered<false, false>();
+		}
+	}
+}
+
+// Emulates cpu instructions until screen is drawn.
+bool CPU::emulate() {
+	if(trace) {
+		return profile ? emulateInstruction<true, true>() : emulateInstruction<true, false>();
+	}
+	return profile ? emulateInstruction<false, true>() : emulateInstruction<false, false>();
+}
+
 int CPU::load(int addr) {
 	return addr<0x2000 ? (*mem)[addr&0x7FF] : mmap->load(addr);
 }
@@ -1353,6 +1399,7 @@ void CPU::doNonMaskableInterrupt(int status) {
 
 	int temp = mmap->load(0x2000); // Read PPU status.
 	if((temp&128)!=0) { // Check whether VBlank Interrupts are enabled
+		ChromeTrace::instant("NMI");
 
 		++REG_PC_NEW;
 		push((REG_PC_NEW>>8)&0xFF);
@@ -1376,6 +1423,7 @@ void CPU::doResetInterrupt() {
 }
 
 void CPU::doIrq(int status) {
+	ChromeTrace::instant("IRQ");
 
 	++REG_PC_NEW;
 	push((REG_PC_NEW>>8)&0xFF);
@@ -217,3 +217,45 @@ void ChannelDM::reset() {
 	reg4013 = 0;
 	data = 0;
 }
+
+void ChannelDM::stateLoad(ByteBuffer* buf) {
+	_isEnabled = buf->readBoolean();
+	hasSample = buf->readBoolean();
+	irqGenerated = buf->readBoolean();
+	playMode = buf->readInt();
+	dmaFrequency = buf->readInt();
+	dmaCounter = buf->readInt();
+	deltaCounter = buf->readInt();
+	playStartAddress = buf->readInt();
+	playAddress = buf->readInt();
+	playLength = buf->readInt();
+	playLengthCounter = buf->readInt();
+	shiftCounter = buf->readInt();
+	reg4012 = buf->readInt();
+	reg4013 = buf->readInt();
+	status = buf->readInt();
+	sample = buf->readInt();
+	dacLsb = buf->readInt();
+	data = buf->readInt();
+}
+
+void ChannelDM::stateSave(ByteBuffer* buf) {
+	buf->putBoolean(_isEnabled);
+	buf->putBoolean(hasSample);
+	buf->putBoolean(irqGenerated);
+	buf->putInt(playMode);
+	buf->putInt(dmaFrequency);
+	buf->putInt(dmaCounter);
+	buf->putInt(deltaCounter);
+	buf->putInt(playStartAddress);
+	buf->putInt(playAddress);
+	buf->putInt(playLength);
+	buf->putInt(playLengthCounter);
+	buf->putInt(shiftCounter);
+	buf->putInt(reg4012);
+	buf->putInt(reg4013);
+	buf->putInt(status);
+	buf->putInt(sample);
+	buf->putInt(dacLsb);
+	buf->putInt(data);
+}
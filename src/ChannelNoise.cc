@@ -138,3 +138,47 @@ void ChannelNoise::reset() {
 	sampleValue = 0;
 	tmp = 0;
 }
+
+void ChannelNoise::stateLoad(ByteBuffer* buf) {
+	_isEnabled = buf->readBoolean();
+	envDecayDisable = buf->readBoolean();
+	envDecayLoopEnable = buf->readBoolean();
+	lengthCounterEnable = buf->readBoolean();
+	envReset = buf->readBoolean();
+	shiftNow = buf->readBoolean();
+	lengthCounter = buf->readInt();
+	progTimerCount = buf->readInt();
+	progTimerMax = buf->readInt();
+	envDecayRate = buf->readInt();
+	envDecayCounter = buf->readInt();
+	envVolume = buf->readInt();
+	masterVolume = buf->readInt();
+	shiftReg = buf->readInt();
+	randomBit = buf->readInt();
+	randomMode = buf->readInt();
+	sampleValue = buf->readInt();
+	accValue = static_cast<uint32_t>(buf->readInt());
+	accCount = static_cast<uint32_t>(buf->readInt());
+}
+
+void ChannelNoise::stateSave(ByteBuffer* buf) {
+	buf->putBoolean(_isEnabled);
+	buf->putBoolean(envDecayDisable);
+	buf->putBoolean(envDecayLoopEnable);
+	buf->putBoolean(lengthCounterEnable);
+	buf->putBoolean(envReset);
+	buf->putBoolean(shiftNow);
+	buf->putInt(lengthCounter);
+	buf->putInt(progTimerCount);
+	buf->putInt(progTimerMax);
+	buf->putInt(envDecayRate);
+	buf->putInt(envDecayCounter);
+	buf->putInt(envVolume);
+	buf->putInt(masterVolume);
+	buf->putInt(shiftReg);
+	buf->putInt(randomBit);
+	buf->putInt(randomMode);
+	buf->putInt(sampleValue);
+	buf->putInt(static_cast<int>(accValue));
+	buf->putInt(static_cast<int>(accCount));
+}
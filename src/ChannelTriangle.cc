@@ -156,3 +156,33 @@ void ChannelTriangle::reset() {
 	tmp = 0;
 	sampleValue = 0xF;
 }
+
+void ChannelTriangle::stateLoad(ByteBuffer* buf) {
+	_isEnabled = buf->readBoolean();
+	sampleCondition = buf->readBoolean();
+	lengthCounterEnable = buf->readBoolean();
+	lcHalt = buf->readBoolean();
+	lcControl = buf->readBoolean();
+	progTimerCount = buf->readInt();
+	progTimerMax = buf->readInt();
+	triangleCounter = buf->readInt();
+	lengthCounter = buf->readInt();
+	linearCounter = buf->readInt();
+	lcLoadValue = buf->readInt();
+	sampleValue = buf->readInt();
+}
+
+void ChannelTriangle::stateSave(ByteBuffer* buf) {
+	buf->putBoolean(_isEnabled);
+	buf->putBoolean(sampleCondition);
+	buf->putBoolean(lengthCounterEnable);
+	buf->putBoolean(lcHalt);
+	buf->putBoolean(lcControl);
+	buf->putInt(progTimerCount);
+	buf->putInt(progTimerMax);
+	buf->putInt(triangleCounter);
+	buf->putInt(lengthCounter);
+	buf->putInt(linearCounter);
+	buf->putInt(lcLoadValue);
+	buf->putInt(sampleValue);
+}
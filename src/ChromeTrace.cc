@@ -0,0 +1,215 @@
+/*
+Copyright (c) 2012-2017 Matthew Brennan Jones <matthew.brennan.jones@gmail.com>
+A NES emulator in WebAssembly. Based on vNES.
+Licensed under GPLV3 or later
+Hosted at: https://github.com/workhorsy/SaltyNES
+*/
+
+/*
+This class writes a Chrome Trace Event JSON file, that can be opened in
+chrome://tracing or https://ui.perfetto.dev. Every thread that records events
+gets its own ring of events, that only it writes to. A ring is made when its
+thread is named, or reserved for it, so recording never allocates. A
+background thread empties the rings into the file, so recording never waits
+on disk or locks. If a ring fills up, events are dropped and counted.
+*/
+
+#include "SaltyNES.h"
+
+atomic<bool> ChromeTrace::_is_on(false);
+FILE* ChromeTrace::_file = nullptr;
+bool ChromeTrace::_first_event = true;
+uint64_t ChromeTrace::_start_ticks = 0;
+atomic<bool> ChromeTrace::_stop_writer(false);
+std::thread ChromeTrace::_writer;
+std::mutex ChromeTrace::_buffers_mutex;
+array<ChromeTrace::ThreadBuffer*, ChromeTrace::MAX_THREADS> ChromeTrace::_buffers;
+atomic<size_t> ChromeTrace::_buffer_count(0);
+atomic<size_t> ChromeTrace::_session(0);
+atomic<size_t> ChromeTrace::_unregistered_dropped(0);
+
+// The calling thread's buffer, and the trace it was made for:
+static thread_local ChromeTrace::ThreadBuffer* t_buffer = nullptr;
+static thread_local size_t t_session = 0;
+
+bool ChromeTrace::init(string file_name) {
+#ifdef DESKTOP
+	_file = fopen(file_name.c_str(), "w");
+	if(!_file) {
+		fprintf(stderr, "Couldn't write trace '%s': %s\n", file_name.c_str(), strerror(errno));
+		return false;
+	}
+
+	fprintf(_file, "{\"traceEvents\":[\n");
+	_first_event = true;
+	_start_ticks = SDL_GetPerformanceCounter();
+	_unregistered_dropped = 0;
+	++_session;
+	_stop_writer = false;
+	_writer = std::thread(ChromeTrace::write_loop);
+	_is_on = true;
+	return true;
+#else
+	fprintf(stderr, "Writing a trace '%s' is only supported on desktop\n", file_name.c_str());
+	return false;
+#endif
+}
+
+// The threads that record events must be stopped before this is called, as
+// it frees their buffers:
+void ChromeTrace::close() {
+	if(!_is_on) return;
+
+	// Stop the writer, then write what is left:
+	_is_on = false;
+	_stop_writer = true;
+	if(_writer.joinable()) {
+		_writer.join();
+	}
+	flush();
+
+	// Threads that still have a pointer to their buffer see it is from an
+	// old trace, so it is never used again:
+	++_session;
+	size_t dropped = _unregistered_dropped;
+	size_t count = _buffer_count;
+	for(size_t i = 0; i < count; ++i) {
+		dropped += _buffers[i]->dropped;
+		delete _buffers[i];
+		_buffers[i] = nullptr;
+	}
+	_buffer_count = 0;
+
+	fprintf(_file, "\n]}\n");
+	fclose(_file);
+	_file = nullptr;
+	if(dropped > 0) {
+		fprintf(stderr, "Trace dropped %zu events\n", dropped);
+	}
+}
+
+// Gives the calling thread its buffer. Threads should call this when they
+// start, so their buffer isn't allocated in the middle of their work:
+void ChromeTrace::name_thread(const char* name) {
+	if(!is_on()) return;
+
+	ThreadBuffer* buffer = add_buffer(name, true);
+	if(buffer) {
+		t_buffer = buffer;
+		t_session = _session;
+	}
+}
+
+// Makes a buffer for a thread that can't name itself before its first event,
+// like SDL's audio thread. That thread takes it when it first records one:
+void ChromeTrace::reserve_thread(const char* name) {
+	if(!is_on()) return;
+
+	add_buffer(name, false);
+}
+
+ChromeTrace::ThreadBuffer* ChromeTrace::add_buffer(const char* name, bool is_claimed) {
+	std::lock_guard<std::mutex> lock(_buffers_mutex);
+	size_t count = _buffer_count.load(std::memory_order_relaxed);
+	if(count >= MAX_THREADS) {
+		fprintf(stderr, "Trace can't record more than %zu threads\n", MAX_THREADS);
+		return nullptr;
+	}
+
+	ThreadBuffer* buffer = new ThreadBuffer();
+	buffer->head = 0;
+	buffer->tail = 0;
+	buffer->dropped = 0;
+	buffer->tid = static_cast<int>(count) + 1;
+	push_to(buffer, name, 'M', nullptr, 0, nullptr, 0);
+	buffer->is_claimed.store(is_claimed, std::memory_order_release);
+	_buffers[count] = buffer;
+	_buffer_count.store(count + 1, std::memory_order_release);
+	return buffer;
+}
+
+void ChromeTrace::push(const char* name, char phase, const char* arg_name0, int arg0, const char* arg_name1, int arg1) {
+	size_t session = _session.load(std::memory_order_relaxed);
+
+	// Take a reserved buffer if this thread doesn't have one yet:
+	if(!t_buffer || t_session != session) {
+		t_buffer = nullptr;
+		size_t count = _buffer_count.load(std::memory_order_acquire);
+		for(size_t i = 0; i < count; ++i) {
+			bool is_claimed = false;
+			if(_buffers[i]->is_claimed.compare_exchange_strong(is_claimed, true, std::memory_order_acq_rel)) {
+				t_buffer = _buffers[i];
+				t_session = session;
+				break;
+			}
+		}
+		if(!t_buffer) {
+			++_unregistered_dropped;
+			return;
+		}
+	}
+
+	push_to(t_buffer, name, phase, arg_name0, arg0, arg_name1, arg1);
+}
+
+void ChromeTrace::push_to(ThreadBuffer* buffer, const char* name, char phase, const char* arg_name0, int arg0, const char* arg_name1, int arg1) {
+	size_t head = buffer->head.load(std::memory_order_relaxed);
+	if(head - buffer->tail.load(std::memory_order_acquire) >= BUFFER_SIZE) {
+		++buffer->dropped;
+		return;
+	}
+
+	Event& e = buffer->events[head & (BUFFER_SIZE - 1)];
+	e.name = name;
+	e.phase = phase;
+	e.ticks = SDL_GetPerformanceCounter();
+	e.arg_names[0] = arg_name0;
+	e.arg_names[1] = arg_name1;
+	e.args[0] = arg0;
+	e.args[1] = arg1;
+	buffer->head.store(head + 1, std::memory_order_release);
+}
+
+// Writes all waiting events to the file:
+void ChromeTrace::flush() {
+	double to_us = 1000000.0 / SDL_GetPerformanceFrequency();
+
+	size_t count = _buffer_count.load(std::memory_order_acquire);
+	for(size_t i = 0; i < count; ++i) {
+		ThreadBuffer* buffer = _buffers[i];
+		size_t tail = buffer->tail.load(std::memory_order_relaxed);
+		size_t head = buffer->head.load(std::memory_order_acquire);
+		for(; tail != head; ++tail) {
+			const Event& e = buffer->events[tail & (BUFFER_SIZE - 1)];
+			fprintf(_file, "%s", _first_event ? "" : ",\n");
+			_first_event = false;
+
+			if(e.phase == 'M') {
+				fprintf(_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", buffer->tid, e.name);
+				continue;
+			}
+
+			fprintf(_file, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d",
+				e.name, e.phase, (e.ticks - _start_ticks) * to_us, buffer->tid);
+			if(e.phase == 'i') {
+				fprintf(_file, ",\"s\":\"t\"");
+			}
+			if(e.arg_names[0]) {
+				fprintf(_file, ",\"args\":{\"%s\":%d", e.arg_names[0], e.args[0]);
+				if(e.arg_names[1]) {
+					fprintf(_file, ",\"%s\":%d", e.arg_names[1], e.args[1]);
+				}
+				fprintf(_file, "}");
+			}
+			fprintf(_file, "}");
+		}
+		buffer->tail.store(tail, std::memory_order_release);
+	}
+}
+
+void ChromeTrace::write_loop() {
+	while(!_stop_writer) {
+		flush();
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+}
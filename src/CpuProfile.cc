@@ -0,0 +1,212 @@
+/*
+Copyright (c) 2012-2017 Matthew Brennan Jones <matthew.brennan.jones@gmail.com>
+A NES emulator in WebAssembly. Based on vNES.
+Licensed under GPLV3 or later
+Hosted at: https://github.com/workhorsy/SaltyNES
+*/
+
+/*
+This class counts what the CPU spends its time on: opcodes, addressing modes,
+page crossing penalties, reads and writes per 256 byte page, mapper register
+writes and PPU register accesses. It is only fed by the profiling version of
+the CPU loop, and prints a table every few frames.
+*/
+
+#include "SaltyNES.h"
+
+CpuProfile::CpuProfile(int reportFrames) {
+	this->reportFrames = reportFrames > 0 ? reportFrames : 60;
+
+	accessType.fill(ACCESS_NONE);
+	stackBytes.fill(0);
+
+	// Instructions that read their operand:
+	int reads[] = {
+		CpuInfo::INS_ADC, CpuInfo::INS_AND, CpuInfo::INS_BIT, CpuInfo::INS_CMP,
+		CpuInfo::INS_CPX, CpuInfo::INS_CPY, CpuInfo::INS_EOR, CpuInfo::INS_LDA,
+		CpuInfo::INS_LDX, CpuInfo::INS_LDY, CpuInfo::INS_ORA, CpuInfo::INS_SBC
+	};
+	for(int inst : reads) {
+		accessType[inst] = ACCESS_READ;
+	}
+
+	// Instructions that write their operand:
+	accessType[CpuInfo::INS_STA] = ACCESS_WRITE;
+	accessType[CpuInfo::INS_STX] = ACCESS_WRITE;
+	accessType[CpuInfo::INS_STY] = ACCESS_WRITE;
+
+	// Read-modify-write instructions:
+	int modifies[] = {
+		CpuInfo::INS_ASL, CpuInfo::INS_LSR, CpuInfo::INS_ROL,
+		CpuInfo::INS_ROR, CpuInfo::INS_INC, CpuInfo::INS_DEC
+	};
+	for(int inst : modifies) {
+		accessType[inst] = ACCESS_MODIFY;
+	}
+
+	// Stack instructions, and how many bytes they move:
+	accessType[CpuInfo::INS_PHA] = ACCESS_PUSH;	stackBytes[CpuInfo::INS_PHA] = 1;
+	accessType[CpuInfo::INS_PHP] = ACCESS_PUSH;	stackBytes[CpuInfo::INS_PHP] = 1;
+	accessType[CpuInfo::INS_JSR] = ACCESS_PUSH;	stackBytes[CpuInfo::INS_JSR] = 2;
+	accessType[CpuInfo::INS_BRK] = ACCESS_PUSH;	stackBytes[CpuInfo::INS_BRK] = 3;
+	accessType[CpuInfo::INS_PLA] = ACCESS_PULL;	stackBytes[CpuInfo::INS_PLA] = 1;
+	accessType[CpuInfo::INS_PLP] = ACCESS_PULL;	stackBytes[CpuInfo::INS_PLP] = 1;
+	accessType[CpuInfo::INS_RTS] = ACCESS_PULL;	stackBytes[CpuInfo::INS_RTS] = 2;
+	accessType[CpuInfo::INS_RTI] = ACCESS_PULL;	stackBytes[CpuInfo::INS_RTI] = 3;
+
+	clear();
+}
+
+void CpuProfile::clear() {
+	frames = 0;
+	instructions = 0;
+	cycles = 0;
+	pageCrossPenalties = 0;
+	branchesTaken = 0;
+	mapperWrites = 0;
+	oamDmaWrites = 0;
+	opcodes.fill(0);
+	addrModes.fill(0);
+	pageReads.fill(0);
+	pageWrites.fill(0);
+	ppuRegReads.fill(0);
+	ppuRegWrites.fill(0);
+}
+
+void CpuProfile::countInstruction(int opcode, int opinf, int pc, int addr, int extraCycles, int cycleCount) {
+	size_t inst = opinf & 0xFF;
+	int addrMode = (opinf >> 8) & 0xFF;
+	int size = (opinf >> 16) & 0xFF;
+
+	++instructions;
+	cycles += cycleCount;
+	++opcodes[opcode];
+	if(inst >= accessType.size()) {
+		return;
+	}
+	++addrModes[addrMode];
+
+	// Fetching the instruction itself:
+	pageReads[(pc >> 8) & 0xFF] += size;
+
+	// Branches take one extra cycle, and one more if they cross a page:
+	if(addrMode == CpuInfo::ADDR_REL) {
+		if(extraCycles > 0) {
+			++branchesTaken;
+		}
+		if(extraCycles > 1) {
+			++pageCrossPenalties;
+		}
+	} else if(extraCycles > 0) {
+		++pageCrossPenalties;
+	}
+
+	// Indirect modes read their pointer from the zero page:
+	if(addrMode == CpuInfo::ADDR_PREIDXIND || addrMode == CpuInfo::ADDR_POSTIDXIND) {
+		pageReads[0] += 2;
+	}
+
+	// The operand, unless it is part of the instruction:
+	bool hasOperand = addrMode != CpuInfo::ADDR_IMM && addrMode != CpuInfo::ADDR_ACC && addrMode != CpuInfo::ADDR_IMP;
+	switch(accessType[inst]) {
+		case ACCESS_READ:
+			if(hasOperand) {
+				countRead(addr);
+			}
+			break;
+		case ACCESS_WRITE:
+			countWrite(addr);
+			break;
+		case ACCESS_MODIFY:
+			if(hasOperand) {
+				countRead(addr);
+				countWrite(addr);
+			}
+			break;
+		case ACCESS_PUSH:
+			pageWrites[1] += stackBytes[inst];
+			break;
+		case ACCESS_PULL:
+			pageReads[1] += stackBytes[inst];
+			break;
+	}
+}
+
+void CpuProfile::countRead(int addr) {
+	++pageReads[(addr >> 8) & 0xFF];
+	if(addr >= 0x2000 && addr < 0x4000) {
+		++ppuRegReads[addr & 7];
+	}
+}
+
+void CpuProfile::countWrite(int addr) {
+	++pageWrites[(addr >> 8) & 0xFF];
+	if(addr >= 0x2000 && addr < 0x4000) {
+		++ppuRegWrites[addr & 7];
+	} else if(addr == 0x4014) {
+		++oamDmaWrites;
+	} else if(addr >= 0x8000) {
+		++mapperWrites;
+	}
+}
+
+void CpuProfile::endFrame() {
+	++frames;
+	if(frames >= reportFrames) {
+		report(stdout);
+		clear();
+	}
+}
+
+void CpuProfile::report(FILE* out) {
+	fprintf(out, "CPU profile: %d frames, %llu instructions, %llu cycles, %u page cross penalties, %u branches taken\n",
+		frames,
+		static_cast<unsigned long long>(instructions),
+		static_cast<unsigned long long>(cycles),
+		pageCrossPenalties, branchesTaken);
+
+	// Most used opcodes:
+	array<int, 256> order;
+	for(size_t i = 0; i < order.size(); ++i) {
+		order[i] = static_cast<int>(i);
+	}
+	std::sort(order.begin(), order.end(), [this](int a, int b) {
+		return opcodes[a] > opcodes[b];
+	});
+	fprintf(out, "  Opcodes:\n");
+	for(size_t i = 0; i < 10 && opcodes[order[i]] > 0; ++i) {
+		int opinf = CpuInfo::opdata[order[i]];
+		size_t inst = opinf & 0xFF;
+		string mode = inst < accessType.size() ? CpuInfo::getAddressModeName((opinf >> 8) & 0xFF) : "";
+		fprintf(out, "    %02X %s %s %10u  %5.1f%%\n",
+			order[i], CpuInfo::getInstName(inst).c_str(), mode.c_str(), opcodes[order[i]],
+			instructions ? 100.0 * opcodes[order[i]] / instructions : 0.0);
+	}
+
+	// Addressing modes:
+	fprintf(out, "  Addressing modes:\n");
+	for(size_t i = 0; i < addrModes.size(); ++i) {
+		if(addrModes[i] > 0) {
+			fprintf(out, "    %s %10u\n", CpuInfo::getAddressModeName(static_cast<int>(i)).c_str(), addrModes[i]);
+		}
+	}
+
+	// Busiest pages:
+	std::sort(order.begin(), order.end(), [this](int a, int b) {
+		return pageReads[a] + pageWrites[a] > pageReads[b] + pageWrites[b];
+	});
+	fprintf(out, "  Pages:\n");
+	for(size_t i = 0; i < 16 && pageReads[order[i]] + pageWrites[order[i]] > 0; ++i) {
+		fprintf(out, "    $%02X00  reads %10u  writes %10u\n", order[i], pageReads[order[i]], pageWrites[order[i]]);
+	}
+
+	// PPU and mapper registers:
+	fprintf(out, "  PPU registers:\n");
+	for(size_t i = 0; i < ppuRegReads.size(); ++i) {
+		if(ppuRegReads[i] > 0 || ppuRegWrites[i] > 0) {
+			fprintf(out, "    $%04X   reads %10u  writes %10u\n", static_cast<int>(0x2000 + i), ppuRegReads[i], ppuRegWrites[i]);
+		}
+	}
+	fprintf(out, "  OAM DMA writes: %u, mapper register writes: %u\n", oamDmaWrites, mapperWrites);
+	fflush(out);
+}
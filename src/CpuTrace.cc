@@ -0,0 +1,85 @@
+/*
+Copyright (c) 2012-2017 Matthew Brennan Jones <matthew.brennan.jones@gmail.com>
+A NES emulator in WebAssembly. Based on vNES.
+Licensed under GPLV3 or later
+Hosted at: https://github.com/workhorsy/SaltyNES
+*/
+
+/*
+This class keeps the last few thousand instructions the CPU executed in a
+preallocated ring. It is only filled when the CPU runs its tracing loop, so
+the normal loop does not pay for it. The ring is written out as raw binary,
+and format() turns a dump back into readable lines offline.
+*/
+
+#include "SaltyNES.h"
+
+static const char TRACE_MAGIC[8] = { 'S', 'N', 'T', 'R', 'A', 'C', 'E', '1' };
+
+const string CpuTrace::DEFAULT_FILE = "cpu_trace.bin";
+
+CpuTrace::CpuTrace() {
+	clear();
+}
+
+void CpuTrace::clear() {
+	pos = 0;
+	cycles = 0;
+	for(size_t i = 0; i < SIZE; ++i) {
+		ring[i] = Entry();
+	}
+}
+
+// Writes the ring, oldest instruction first:
+bool CpuTrace::dump(string file_name) {
+	FILE* file = fopen(file_name.c_str(), "wb");
+	if(!file) {
+		fprintf(stderr, "Couldn't write CPU trace '%s': %s\n", file_name.c_str(), strerror(errno));
+		return false;
+	}
+
+	size_t start = pos > SIZE ? pos - SIZE : 0;
+	uint32_t count = static_cast<uint32_t>(pos - start);
+	fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC), 1, file);
+	fwrite(&count, sizeof(count), 1, file);
+	for(size_t i = start; i < pos; ++i) {
+		fwrite(&ring[i & (SIZE - 1)], sizeof(Entry), 1, file);
+	}
+	fclose(file);
+
+	printf("Wrote the last %u CPU instructions to '%s'\n", count, file_name.c_str());
+	return true;
+}
+
+// Prints a dump made by dump() as one instruction per line:
+bool CpuTrace::format(string file_name, FILE* out) {
+	FILE* file = fopen(file_name.c_str(), "rb");
+	if(!file) {
+		fprintf(stderr, "Couldn't read CPU trace '%s': %s\n", file_name.c_str(), strerror(errno));
+		return false;
+	}
+
+	char magic[sizeof(TRACE_MAGIC)];
+	uint32_t count = 0;
+	if(fread(magic, sizeof(magic), 1, file) != 1 ||
+		memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 ||
+		fread(&count, sizeof(count), 1, file) != 1) {
+		fprintf(stderr, "Not a CPU trace file: '%s'\n", file_name.c_str());
+		fclose(file);
+		return false;
+	}
+
+	CpuInfo::initOpData();
+	Entry e;
+	for(uint32_t i = 0; i < count && fread(&e, sizeof(e), 1, file) == 1; ++i) {
+		int opinf = CpuInfo::opdata[e.opcode];
+		size_t inst = opinf & 0xFF;
+		string mode = inst < CpuInfo::instname.size() ? CpuInfo::getAddressModeName((opinf >> 8) & 0xFF) : "";
+		fprintf(out, "%10u  $%04X  %02X  %s  %-20s  A:%02X X:%02X Y:%02X P:%02X SP:%02X\n",
+			e.cycle, e.pc, e.opcode,
+			CpuInfo::getInstName(inst).c_str(), mode.c_str(),
+			e.a, e.x, e.y, e.p, e.sp);
+	}
+	fclose(file);
+	return true;
+}
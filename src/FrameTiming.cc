@@ -0,0 +1,118 @@
+/*
+Copyright (c) 2012-2017 Matthew Brennan Jones <matthew.brennan.jones@gmail.com>
+A NES emulator in WebAssembly. Based on vNES.
+Licensed under GPLV3 or later
+Hosted at: https://github.com/workhorsy/SaltyNES
+*/
+
+/*
+This class times the parts of each frame: CPU emulation, background and
+sprite rendering, APU sampling, presenting and sleeping. The last few
+seconds of frames are kept so the p50/p95/p99 times can be looked up, which
+shows frame spikes that an FPS average hides. CPU time is what is left of
+the frame after the other parts are taken out.
+*/
+
+#include "SaltyNES.h"
+
+bool FrameTiming::_is_on = false;
+bool FrameTiming::_print_report = false;
+array<uint64_t, FrameTiming::PHASE_COUNT> FrameTiming::_frame_ticks = {{0}};
+array<array<float, FrameTiming::HISTORY>, FrameTiming::PHASE_COUNT> FrameTiming::_history = {{}};
+array<float, FrameTiming::HISTORY> FrameTiming::_sorted = {{0}};
+size_t FrameTiming::_history_pos = 0;
+size_t FrameTiming::_history_count = 0;
+uint64_t FrameTiming::_frame_start = 0;
+int FrameTiming::_frames_since_report = 0;
+atomic<uint32_t> FrameTiming::_bg_lines(0);
+atomic<uint32_t> FrameTiming::_bg_lines_reused(0);
+
+void FrameTiming::init(bool print_report) {
+	_is_on = true;
+	_print_report = print_report;
+	_frame_ticks.fill(0);
+	_history_pos = 0;
+	_history_count = 0;
+	_frame_start = 0;
+	_frames_since_report = 0;
+}
+
+void FrameTiming::end_frame() {
+	if(!_is_on) return;
+
+	uint64_t now = SDL_GetPerformanceCounter();
+	if(_frame_start != 0) {
+		_frame_ticks[PHASE_FRAME] = now - _frame_start;
+
+		// The CPU gets whatever the other parts did not use:
+		uint64_t used = 0;
+		for(int i = PHASE_BACKGROUND; i < PHASE_FRAME; ++i) {
+			used += _frame_ticks[i];
+		}
+		_frame_ticks[PHASE_CPU] = _frame_ticks[PHASE_FRAME] > used ? _frame_ticks[PHASE_FRAME] - used : 0;
+
+		// Save the frame in microseconds:
+		float to_us = 1000000.0f / SDL_GetPerformanceFrequency();
+		for(int i = 0; i < PHASE_COUNT; ++i) {
+			_history[i][_history_pos] = _frame_ticks[i] * to_us;
+		}
+		_history_pos = (_history_pos + 1) % HISTORY;
+		if(_history_count < HISTORY) {
+			++_history_count;
+		}
+
+		// Print the report once a second:
+		++_frames_since_report;
+		if(_print_report && _frames_since_report >= 60) {
+			report(stdout);
+			_frames_since_report = 0;
+		}
+	}
+
+	_frame_ticks.fill(0);
+	_frame_start = now;
+}
+
+// Returns the time in microseconds that p of the saved frames stayed under:
+float FrameTiming::percentile(int phase, float p) {
+	if(_history_count == 0) {
+		return 0;
+	}
+
+	std::copy(_history[phase].begin(), _history[phase].begin() + _history_count, _sorted.begin());
+	size_t n = static_cast<size_t>(p * (_history_count - 1) + 0.5f);
+	std::nth_element(_sorted.begin(), _sorted.begin() + n, _sorted.begin() + _history_count);
+	return _sorted[n];
+}
+
+string FrameTiming::phase_name(int phase) {
+	switch(phase) {
+		case PHASE_CPU: return "cpu";
+		case PHASE_BACKGROUND: return "background";
+		case PHASE_SPRITES: return "sprites";
+		case PHASE_APU: return "apu";
+		case PHASE_PRESENT: return "present";
+		case PHASE_SLEEP: return "sleep";
+		case PHASE_FRAME: return "frame";
+	}
+	return "???";
+}
+
+void FrameTiming::report(FILE* out) {
+	fprintf(out, "Frame times in us over %zu frames:      p50      p95      p99      max\n", _history_count);
+	for(int i = 0; i < PHASE_COUNT; ++i) {
+		fprintf(out, "  %-36s %8.1f %8.1f %8.1f %8.1f\n",
+			phase_name(i).c_str(),
+			percentile(i, 0.50f),
+			percentile(i, 0.95f),
+			percentile(i, 0.99f),
+			percentile(i, 1.0f));
+	}
+
+	// Background lines reused since the last report:
+	uint32_t lines = _bg_lines.exchange(0);
+	uint32_t reused = _bg_lines_reused.exchange(0);
+	fprintf(out, "  background lines reused: %u of %u (%.1f%%)\n",
+		reused, lines, lines == 0 ? 0.0f : reused * 100.0f / lines);
+	fflush(out);
+}
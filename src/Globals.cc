@@ -24,6 +24,11 @@ uint16_t Globals::memoryFlushValue = 0xFF;
 bool Globals::disableSprites = false;
 bool Globals::palEmulation = false;
 bool Globals::enableSound = true;
+bool Globals::enableCpuTrace = false;
+int Globals::cpuProfileFrames = 0;
+bool Globals::skipSameFrames = false;
+bool Globals::pipelinedRendering = false;
+int Globals::frameSkip = 1;
 
 std::map<string, uint32_t> Globals::keycodes; //Java key codes
 std::map<string, string> Globals::controls; //vNES controls codes
@@ -24,14 +24,7 @@ InputHandler::InputHandler(int id) :
 	_is_gamepad_used = false;
 	_is_keyboard_used = false;
 
-	_is_input_pressed["up"] = false;
-	_is_input_pressed["down"] = false;
-	_is_input_pressed["right"] = false;
-	_is_input_pressed["left"] = false;
-	_is_input_pressed["start"] = false;
-	_is_input_pressed["select"] = false;
-	_is_input_pressed["a"] = false;
-	_is_input_pressed["b"] = false;
+	_is_input_pressed.fill(false);
 }
 
 InputHandler::~InputHandler() {
@@ -24,6 +24,7 @@ shared_ptr<MapperDefault> MapperDefault::Init(shared_ptr<NES> nes) {
 	joy2StrobeState = 0;
 	joypadLastWrite = 0;
 	mousePressed = false;
+	zapperUsed = false;
 	gameGenieActive = false;
 	mouseX = 0;
 	mouseY = 0;
@@ -70,7 +71,7 @@ void MapperDefault::stateLoad(ByteBuffer* buf) {
 		joypadLastWrite = buf->readInt();
 
 		// Mapper specific stuff:
-		base_mapperInternalStateLoad(buf);
+		mapperInternalStateLoad(buf);
 
 	}
 }
@@ -85,20 +86,23 @@ void MapperDefault::stateSave(ByteBuffer* buf) {
 	buf->putInt(joypadLastWrite);
 
 	// Mapper specific stuff:
-	base_mapperInternalStateSave(buf);
+	mapperInternalStateSave(buf);
+}
+
+void MapperDefault::mapperInternalStateLoad(ByteBuffer* buf) {
+	base_mapperInternalStateLoad(buf);
 }
 
-void MapperDefault::base_mapperInternalStateLoad(ByteBuffer* buf) {
-	buf->putByte(static_cast<uint16_t>(joy1StrobeState));
-	buf->putByte(static_cast<uint16_t>(joy2StrobeState));
-	buf->putByte(static_cast<uint16_t>(joypadLastWrite));
+void MapperDefault::mapperInternalStateSave(ByteBuffer* buf) {
+	base_mapperInternalStateSave(buf);
+}
 
+void MapperDefault::base_mapperInternalStateLoad(ByteBuffer* /*buf*/) {
+	// The joypad state was loaded by stateLoad
 }
 
-void MapperDefault::base_mapperInternalStateSave(ByteBuffer* buf) {
-	joy1StrobeState = buf->readByte();
-	joy2StrobeState = buf->readByte();
-	joypadLastWrite = buf->readByte();
+void MapperDefault::base_mapperInternalStateSave(ByteBuffer* /*buf*/) {
+	// The joypad state was saved by stateSave
 }
 
 void MapperDefault::setGameGenieState(bool enable) {
@@ -278,7 +282,7 @@ uint16_t MapperDefault::regLoad(int address) {
 
 					// 0x4017:
 					// Joystick 2 + Strobe
-					if(mousePressed && nes->ppu != nullptr && nes->ppu->get_screen_buffer() != nullptr) {
+					if(mousePressed && nes->ppu != nullptr) {
 
 						// Check for white pixel nearby:
 
@@ -291,7 +295,7 @@ uint16_t MapperDefault::regLoad(int address) {
 
 						for(int y = sy; y < ey; ++y) {
 							for(int x = sx; x < ex; ++x) {
-								if(((*nes->ppu->get_screen_buffer())[(y << 8) + x] & 0xFFFFFF) == 0xFFFFFF) {
+								if((nes->ppu->get_screen_color(x, y) & 0xFFFFFF) == 0xFFFFFF) {
 									w = 0x1 << 3;
 									break;
 								}
@@ -421,7 +425,7 @@ void MapperDefault::regWrite(int address, uint16_t value) {
 
 uint16_t MapperDefault::joy1Read() {
 	uint16_t ret = 0;
-	shared_ptr<InputHandler> in = nes->_joy1;
+	InputHandler* in = nes->_joy1.get();
 
 	switch (joy1StrobeState) {
 		case 0:
@@ -478,7 +482,7 @@ uint16_t MapperDefault::joy1Read() {
 
 uint16_t MapperDefault::joy2Read() {
 	uint16_t ret = 0;
-	shared_ptr<InputHandler> in = nes->_joy2;
+	InputHandler* in = nes->_joy2.get();
 
 	switch (joy2StrobeState) {
 		case 0:
@@ -592,6 +596,7 @@ void MapperDefault::loadBatteryRam() {
 }
 
 void MapperDefault::loadRomBank(int bank, int address) {
+	ChromeTrace::instant("loadRomBank", "bank", bank, "address", address);
 	// Loads a ROM bank into the specified address.
 	bank %= rom->getRomBankCount();
 	//array<uint16_t, 16384>* data = rom->getRomBank(bank);
@@ -601,6 +606,7 @@ void MapperDefault::loadRomBank(int bank, int address) {
 }
 
 void MapperDefault::loadVromBank(int bank, int address) {
+	ChromeTrace::instant("loadVromBank", "bank", bank, "address", address);
 	if(rom->getVromBankCount() == 0) {
 		return;
 	}
@@ -610,6 +616,7 @@ void MapperDefault::loadVromBank(int bank, int address) {
 
 	array<Tile, 256>* vromTile = rom->getVromBankTiles(bank % rom->getVromBankCount());
 	array_copy(vromTile, 0, &ppu->ptTile, address >> 4, 256);
+	ppu->tilesChanged(address >> 4, 256);
 }
 
 void MapperDefault::load32kRomBank(int bank, int address) {
@@ -628,6 +635,7 @@ void MapperDefault::load8kVromBank(int bank4kStart, int address) {
 }
 
 void MapperDefault::load1kVromBank(int bank1k, int address) {
+	ChromeTrace::instant("load1kVromBank", "bank", bank1k, "address", address);
 	if(rom->getVromBankCount() == 0) {
 		return;
 	}
@@ -643,9 +651,11 @@ void MapperDefault::load1kVromBank(int bank1k, int address) {
 	for(int i = 0; i < 64; ++i) {
 		ppu->ptTile[baseIndex + i] = (*vromTile)[((bank1k % 4) << 6) + i];
 	}
+	ppu->tilesChanged(baseIndex, 64);
 }
 
 void MapperDefault::load2kVromBank(int bank2k, int address) {
+	ChromeTrace::instant("load2kVromBank", "bank", bank2k, "address", address);
 	if(rom->getVromBankCount() == 0) {
 		return;
 	}
@@ -661,9 +671,11 @@ void MapperDefault::load2kVromBank(int bank2k, int address) {
 	for(int i = 0; i < 128; ++i) {
 		ppu->ptTile[baseIndex + i] = (*vromTile)[((bank2k % 2) << 7) + i];
 	}
+	ppu->tilesChanged(baseIndex, 128);
 }
 
 void MapperDefault::load8kRomBank(int bank8k, int address) {
+	ChromeTrace::instant("load8kRomBank", "bank", bank8k, "address", address);
 	int bank16k = (bank8k / 2) % rom->getRomBankCount();
 	int offset = (bank8k % 2) * 8192;
 
@@ -691,6 +703,7 @@ int MapperDefault::syncH(int scanline) {
 
 void MapperDefault::setMouseState(bool pressed, int x, int y) {
 	mousePressed = pressed;
+	zapperUsed = zapperUsed || pressed;
 	mouseX = x;
 	mouseY = y;
 }
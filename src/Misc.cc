@@ -24,19 +24,15 @@ vector<float>* Misc::rnd() {
 }
 
 string Misc::hex8(int i) {
-	string s = intToHexString(i);
-	while(s.length() < 2) {
-		s = "0" + s;
-	}
-	return toUpperCase(s);
+	char buffer[16];
+	snprintf(buffer, sizeof(buffer), "%02X", i);
+	return buffer;
 }
 
 string Misc::hex16(int i) {
-	string s = intToHexString(i);
-	while(s.length() < 4) {
-		s = "0" + s;
-	}
-	return toUpperCase(s);
+	char buffer[16];
+	snprintf(buffer, sizeof(buffer), "%04X", i);
+	return buffer;
 }
 
 string Misc::binN(int num, int N) {
@@ -16,6 +16,7 @@ shared_ptr<NES> NES::Init(shared_ptr<InputHandler> joy1, shared_ptr<InputHandler
 	_joy2 = joy2;
 
 	this->_is_paused = false;
+	this->_is_snapshot_wanted = false;
 	this->_isRunning = false;
 
 	// Create memory:
@@ -115,7 +116,8 @@ bool NES::stateLoad(ByteBuffer* buf) {
 	stopEmulation();
 
 	// Check version:
-	if(buf->readByte() == 1) {
+	int version = buf->readByte();
+	if(version == 1 || version == 2) {
 
 		// Let units load their state from the buffer:
 		cpuMem->stateLoad(buf);
@@ -124,6 +126,10 @@ bool NES::stateLoad(ByteBuffer* buf) {
 		cpu->stateLoad(buf);
 		memMapper->stateLoad(buf);
 		ppu->stateLoad(buf);
+		// Version 1 has no sound state, so the sound starts from reset:
+		if(version == 2) {
+			papu->stateLoad(buf);
+		}
 		success = true;
 
 	} else {
@@ -141,12 +147,13 @@ bool NES::stateLoad(ByteBuffer* buf) {
 	return success;
 }
 
+// Saves the state while the game keeps running, so it can be done between
+// any two frames:
 void NES::stateSave(ByteBuffer* buf) {
-	bool continueEmulation = isRunning();
-	stopEmulation();
+	cpu->saveRegisters();
 
 	// Version:
-	buf->putByte(static_cast<uint16_t>(1));
+	buf->putByte(static_cast<uint16_t>(2));
 
 	// Let units save their state:
 	cpuMem->stateSave(buf);
@@ -155,12 +162,7 @@ void NES::stateSave(ByteBuffer* buf) {
 	cpu->stateSave(buf);
 	memMapper->stateSave(buf);
 	ppu->stateSave(buf);
-
-	// Continue emulation:
-	if(continueEmulation) {
-		startEmulation();
-	}
-
+	papu->stateSave(buf);
 }
 
 bool NES::isRunning() {
@@ -210,46 +212,46 @@ void NES::setGameGenieState(bool enable) {
 }
 
 // Returns CPU object.
-shared_ptr<CPU> NES::getCpu() {
+const shared_ptr<CPU>& NES::getCpu() {
 	return cpu;
 }
 
 // Returns PPU object.
-shared_ptr<PPU> NES::getPpu() {
+const shared_ptr<PPU>& NES::getPpu() {
 	return ppu;
 }
 
 // Returns pAPU object.
-shared_ptr<PAPU> NES::getPapu() {
+const shared_ptr<PAPU>& NES::getPapu() {
 	return papu;
 }
 
 // Returns CPU Memory.
-shared_ptr<Memory> NES::getCpuMemory() {
+const shared_ptr<Memory>& NES::getCpuMemory() {
 	return cpuMem;
 }
 
 // Returns PPU Memory.
-shared_ptr<Memory> NES::getPpuMemory() {
+const shared_ptr<Memory>& NES::getPpuMemory() {
 	return ppuMem;
 }
 
 // Returns Sprite Memory.
-shared_ptr<Memory> NES::getSprMemory() {
+const shared_ptr<Memory>& NES::getSprMemory() {
 	return sprMem;
 }
 
 // Returns the currently loaded ROM.
-shared_ptr<ROM> NES::getRom() {
+const shared_ptr<ROM>& NES::getRom() {
 	return rom;
 }
 
 // Returns the memory mapper.
-shared_ptr<MapperDefault> NES::getMemoryMapper() {
+const shared_ptr<MapperDefault>& NES::getMemoryMapper() {
 	return memMapper;
 }
 
-bool NES::load_rom_from_data(string rom_name, vector<uint8_t>* data, array<uint16_t, 0x2000>* save_ram) {
+bool NES::load_rom_from_data(string rom_name, const uint8_t* data, size_t size, array<uint16_t, 0x2000>* save_ram) {
 	// Can't load ROM while still running.
 	if(_isRunning) {
 		stopEmulation();
@@ -259,7 +261,7 @@ bool NES::load_rom_from_data(string rom_name, vector<uint8_t>* data, array<uint1
 		// Load ROM file:
 
 		rom = make_shared<ROM>()->Init(shared_from_this());
-		rom->load_from_data(rom_name, data, save_ram);
+		rom->load_from_data(rom_name, data, size, save_ram);
 
 		if(rom->isValid()) {
 
@@ -67,10 +67,7 @@ void NameTable::writeAttrib(int index, int value) {
 
 void NameTable::stateSave(ByteBuffer* buf) {
 	for(int i = 0; i < width * height; ++i) {
-		if(tile[i] > 255)//System.out.println(">255!!");
-		{
-			buf->putByte(static_cast<uint8_t>(tile[i]));
-		}
+		buf->putByte(static_cast<uint8_t>(tile[i]));
 	}
 	for(int i = 0; i < width * height; ++i) {
 		buf->putByte(static_cast<uint8_t>(attrib[i]));
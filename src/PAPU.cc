@@ -17,9 +17,11 @@ void fill_audio_sdl_cb(void* udata, uint8_t* stream, int len) {
 
 	PAPU* papu = reinterpret_cast<PAPU*>(udata);
 
+	ChromeTrace::instant("audio callback", "ready", papu->ready_for_buffer_write ? 1 : 0, "len", len);
 	if(!papu->ready_for_buffer_write)
 		return;
 
+	ChromeTrace::begin("audio mix");
 	uint32_t mix_len = len > papu->bufferIndex ? papu->bufferIndex : len;
 	if (! papu->_is_muted) {
 		SDL_MixAudio(stream, papu->sampleBuffer.data(), mix_len, SDL_MIX_MAXVOLUME);
@@ -27,6 +29,7 @@ void fill_audio_sdl_cb(void* udata, uint8_t* stream, int len) {
 	papu->bufferIndex = 0;
 	//std::fill(papu->sampleBuffer.begin(), papu->sampleBuffer.end(), 0);
 	papu->ready_for_buffer_write = false;
+	ChromeTrace::end("audio mix");
 }
 
 const uint8_t PAPU::panning[] = {
@@ -210,6 +213,9 @@ shared_ptr<PAPU> PAPU::Init(shared_ptr<NES> nes) {
 	desiredSpec.callback = fill_audio_sdl_cb;
 	desiredSpec.userdata = this;
 
+	// The audio thread's events go in a buffer made now, not in the callback
+	ChromeTrace::reserve_thread("audio");
+
 	if(SDL_OpenAudio(&desiredSpec, nullptr) != 0) {
 		fprintf(stderr, "Couldn't open audio: %s\n", SDL_GetError());
 		exit(1);
@@ -232,13 +238,83 @@ PAPU::~PAPU() {
 }
 
 void PAPU::stateLoad(ByteBuffer* buf) {
-	assert(buf);
-	// not yet.
+	// Check version:
+	if(buf->readByte() == 1) {
+
+		// Channels:
+		square1.stateLoad(buf);
+		square2.stateLoad(buf);
+		triangle.stateLoad(buf);
+		noise.stateLoad(buf);
+		dmc.stateLoad(buf);
+		channelEnableValue = static_cast<uint16_t>(buf->readInt());
+
+		// Frame counter and IRQ:
+		frameIrqCounter = buf->readInt();
+		frameIrqCounterMax = buf->readInt();
+		frameIrqEnabled = buf->readBoolean();
+		frameIrqActive = buf->readBoolean();
+		frameClockNow = buf->readBoolean();
+		masterFrameCounter = buf->readInt();
+		derivedFrameCounter = buf->readInt();
+		countSequence = buf->readInt();
+		initCounter = buf->readInt();
+		initingHardware = buf->readBoolean();
+		extraCycles = buf->readInt();
+
+		// Sampling, which is kept so the sound goes on without a click:
+		sampleTimer = buf->readInt();
+		triValue = buf->readInt();
+		smpSquare1 = buf->readInt();
+		smpSquare2 = buf->readInt();
+		smpTriangle = buf->readInt();
+		smpDmc = buf->readInt();
+		accCount = buf->readInt();
+		prevSampleL = buf->readInt();
+		prevSampleR = buf->readInt();
+		smpAccumL = buf->readInt();
+		smpAccumR = buf->readInt();
+
+	}
 }
 
 void PAPU::stateSave(ByteBuffer* buf) {
-	assert(buf);
-	// not yet.
+	// Version:
+	buf->putByte(static_cast<uint16_t>(1));
+
+	// Channels:
+	square1.stateSave(buf);
+	square2.stateSave(buf);
+	triangle.stateSave(buf);
+	noise.stateSave(buf);
+	dmc.stateSave(buf);
+	buf->putInt(channelEnableValue);
+
+	// Frame counter and IRQ:
+	buf->putInt(frameIrqCounter);
+	buf->putInt(frameIrqCounterMax);
+	buf->putBoolean(frameIrqEnabled);
+	buf->putBoolean(frameIrqActive);
+	buf->putBoolean(frameClockNow);
+	buf->putInt(masterFrameCounter);
+	buf->putInt(derivedFrameCounter);
+	buf->putInt(countSequence);
+	buf->putInt(initCounter);
+	buf->putBoolean(initingHardware);
+	buf->putInt(extraCycles);
+
+	// Sampling:
+	buf->putInt(sampleTimer);
+	buf->putInt(triValue);
+	buf->putInt(smpSquare1);
+	buf->putInt(smpSquare2);
+	buf->putInt(smpTriangle);
+	buf->putInt(smpDmc);
+	buf->putInt(accCount);
+	buf->putInt(prevSampleL);
+	buf->putInt(prevSampleR);
+	buf->putInt(smpAccumL);
+	buf->putInt(smpAccumR);
 }
 
 void PAPU::synchronized_start() {
@@ -659,6 +735,7 @@ void PAPU::frameCounterTick() {
 // Samples the channels, mixes the output together,
 // writes to buffer and (if enabled) file.
 void PAPU::sample() {
+	uint64_t timing = FrameTiming::start();
 	if(accCount > 0) {
 		smpSquare1 <<= 4;
 		smpSquare1 /= accCount;
@@ -768,6 +845,8 @@ void PAPU::sample() {
 	smpSquare2 = 0;
 	smpTriangle = 0;
 	smpDmc = 0;
+
+	FrameTiming::stop(FrameTiming::PHASE_APU, timing);
 }
 
 // Writes the sound buffer to the output line:
@@ -10,8 +10,42 @@ Hosted at: https://github.com/workhorsy/SaltyNES
 
 const size_t PPU::UNDER_SCAN = 8;
 
-array<int, 256 * 240>* PPU::get_screen_buffer() {
-	return &_screen_buffer;
+// Returns the RGB color of a pixel drawn this frame:
+uint32_t PPU::get_screen_color(int x, int y) {
+	// When pipelined the frame is not drawn yet, so there is no light. The
+	// pipeline is stopped before the zapper's first frame, so it never looks:
+	if(pipeline) {
+		return 0x000000;
+	}
+	return screenColor(renderer->screen[(y << 8) + x]);
+}
+
+// Converts a screen color index to RGB:
+uint32_t PPU::screenColor(uint8_t index) {
+	switch(index) {
+		case COLOR_SPR0: return 0xFF5555;
+		case COLOR_SPR0_HIT: return 0x55FF55;
+	}
+	if(index >= COLOR_BLACK) {
+		return 0x000000;
+	}
+	return PaletteTable::adjTable[emphSlots[index >> 6]][index & 63];
+}
+
+// Picks the emphasis slot that new pixels are drawn with. A frame can use 3
+// emphasis settings, after that the last slot is reused:
+void PPU::setEmphasisSlot(int emph) {
+	for(int i = 0; i < emphSlotCount; ++i) {
+		if(emphSlots[i] == emph) {
+			emphSlot = i;
+			return;
+		}
+	}
+	if(emphSlotCount < static_cast<int>(emphSlots.size())) {
+		++emphSlotCount;
+	}
+	emphSlot = emphSlotCount - 1;
+	emphSlots[emphSlot] = emph;
 }
 
 vector<int>* PPU::get_pattern_buffer() {
@@ -76,8 +110,6 @@ shared_ptr<PPU> PPU::Init(shared_ptr<NES> nes) {
 	vramTmpAddress = 0;
 	vramBufferedReadValue = 0;
 	firstWrite = true;
-	vramMirrorTable.fill(0);
-	i = 0;
 
 	// SPR-RAM I/O:
 	sramAddress = 0;
@@ -106,77 +138,79 @@ shared_ptr<PPU> PPU::Init(shared_ptr<NES> nes) {
 	mapperIrqCounter = 0;
 
 	// Sprite data:
-	sprX.fill(0);
-	sprY.fill(0);
-	sprTile.fill(0);
-	sprCol.fill(0);
-	vertFlip.fill(false);
-	horiFlip.fill(false);
-	bgPriority.fill(false);
+	spr.sprX.fill(0);
+	spr.sprY.fill(0);
+	spr.sprTile.fill(0);
+	spr.sprCol.fill(0);
+	spr.vertFlip.fill(false);
+	spr.horiFlip.fill(false);
+	spr.bgPriority.fill(false);
+	spr.spriteLines.fill(0);
+	spr.spritesBehindBg = 0;
+	spriteLinesDirty = true;
+	spriteLinesHeight = 8;
 	spr0HitX = 0;
 	spr0HitY = 0;
 	hitSpr0 = false;
 
 	// Tiles:
 	//ptTile.fill(nullptr);
+	pendingTile = -1;
+	pendingRows = 0;
 	// Name table data:
 	ntable1.fill(0);
 	//nameTable.fill(nullptr);
 	currentMirroring = -1;
 
 	// Palette data:
-	sprPalette.fill(0);
-	imgPalette.fill(0);
+	for(size_t i = 0; i < sprPalettes.size(); ++i) {
+		sprPalettes[i].fill(0);
+		imgPalettes[i].fill(0);
+	}
+	sprPalette = &sprPalettes[0];
+	imgPalette = &imgPalettes[0];
+	emphSlots.fill(0);
+	emphSlotCount = 1;
+	emphSlot = 0;
 
 	// Misc:
 	scanlineAlreadyRendered = false;
 	requestEndFrame = false;
 	nmiOk = false;
 	nmiCounter = 0;
-	tmp = 0;
 	dummyCycleToggle = false;
 
-	// Vars used when updating regs/address:
-	address = 0;
-	b1 = 0;
-	b2 = 0;
-
 	// Variables used when rendering:
-	attrib.fill(0);
-	bgbuffer.fill(0);
-	pixrendered.fill(0);
 	//dummyPixPriTable = vector<int>(256 * 240, 0);
-	tpix = nullptr;
 	requestRenderAll = false;
 	validTileData = false;
-	att = 0;
-	scantile.fill(nullptr);
-	t = nullptr;
-
-	// These are temporary variables used in rendering and sound procedures.
-	// Their states outside of those procedures can be ignored.
-	curNt = 0;
-	destIndex = 0;
-	x = 0;
-	y = 0;
-	sx = 0;
-	si = 0;
-	ei = 0;
-	tile = 0;
-	col = 0;
-	baseTile = 0;
-	tscanoffset = 0;
-	srcy1 = 0;
-	srcy2 = 0;
-	bufferSize = 0;
-	available = 0;
+	bgLine.scan = -1;
+	bgLine.fineX = 0;
+	bgLine.fineY = 0;
+	bgLine.toScreen = false;
+	bgLine.tiles.fill(0);
+	bgLine.attribs.fill(0);
+	renderer = make_shared<PpuRenderer>();
+	renderer->tiles = &ptTile;
+	renderer->imgPalette = imgPalette;
+	renderer->sprPalette = sprPalette;
+	renderer->sprites = &spr;
+	pipeline = nullptr;
+	changedTiles.fill(0);
+	changedPalettes = false;
+	changedSprites = false;
+	// Nothing is drawn until the first frame starts, which is
+	// the same as sprite 0 covering everything:
+	spr0DrawnTo = 239;
+	isSkippingFrame = false;
+	skippedFrames = 0;
 	cycles = 0;
-	_screen_buffer.fill(0);
 
 	return shared_from_this();
 }
 
 PPU::~PPU() {
+	stopPipeline();
 	nes = nullptr;
 	ppuMem = nullptr;
 	sprMem = nullptr;
@@ -205,13 +239,22 @@ void PPU::init() {
 		nameTable[i].name = name.str();
 	}
 
-	// Initialize mirroring lookup table:
-	for(size_t i = 0; i < 0x8000; ++i) {
-		vramMirrorTable[i] = i;
+	// No nametable mirroring, until it is set:
+	for(size_t i = 0; i < nametablePages.size(); ++i) {
+		nametablePages[i] = 0x2000 + (i << 10);
 	}
 
 	lastRenderedScanline = -1;
 	curX = 0;
+
+	// Draw on a worker thread, starting with all the tiles:
+	if(Globals::pipelinedRendering) {
+		pipeline = make_shared<PpuPipeline>();
+		pipeline->start();
+		tilesChanged(0, ptTile.size());
+		changedPalettes = true;
+		changedSprites = true;
+	}
 }
 
 // Sets Nametable mirroring.
@@ -223,21 +266,8 @@ void PPU::setMirroring(int mirroring) {
 	currentMirroring = mirroring;
 	triggerRendering();
 
-	// Remove mirroring:
-	for(size_t i = 0; i < 0x8000; ++i) {
-		vramMirrorTable[i] = i;
-	}
-
-	// Palette mirroring:
-	defineMirrorRegion(0x3f20, 0x3f00, 0x20);
-	defineMirrorRegion(0x3f40, 0x3f00, 0x20);
-	defineMirrorRegion(0x3f80, 0x3f00, 0x20);
-	defineMirrorRegion(0x3fc0, 0x3f00, 0x20);
-
-	// Additional mirroring:
-	defineMirrorRegion(0x3000, 0x2000, 0xf00);
-	defineMirrorRegion(0x4000, 0x0000, 0x4000);
-
+	// Only the nametable pages change, the palette
+	// and other mirroring is in mirrorAddress:
 	if(mirroring == ROM::HORIZONTAL_MIRRORING) {
 
 
@@ -248,8 +278,10 @@ void PPU::setMirroring(int mirroring) {
 		ntable1[2] = 1;
 		ntable1[3] = 1;
 
-		defineMirrorRegion(0x2400, 0x2000, 0x400);
-		defineMirrorRegion(0x2c00, 0x2800, 0x400);
+		nametablePages[0] = 0x2000;
+		nametablePages[1] = 0x2000;
+		nametablePages[2] = 0x2800;
+		nametablePages[3] = 0x2800;
 
 	} else if(mirroring == ROM::VERTICAL_MIRRORING) {
 
@@ -260,8 +292,10 @@ void PPU::setMirroring(int mirroring) {
 		ntable1[2] = 0;
 		ntable1[3] = 1;
 
-		defineMirrorRegion(0x2800, 0x2000, 0x400);
-		defineMirrorRegion(0x2c00, 0x2400, 0x400);
+		nametablePages[0] = 0x2000;
+		nametablePages[1] = 0x2400;
+		nametablePages[2] = 0x2000;
+		nametablePages[3] = 0x2400;
 
 	} else if(mirroring == ROM::SINGLESCREEN_MIRRORING) {
 
@@ -272,9 +306,10 @@ void PPU::setMirroring(int mirroring) {
 		ntable1[2] = 0;
 		ntable1[3] = 0;
 
-		defineMirrorRegion(0x2400, 0x2000, 0x400);
-		defineMirrorRegion(0x2800, 0x2000, 0x400);
-		defineMirrorRegion(0x2c00, 0x2000, 0x400);
+		nametablePages[0] = 0x2000;
+		nametablePages[1] = 0x2000;
+		nametablePages[2] = 0x2000;
+		nametablePages[3] = 0x2000;
 
 	} else if(mirroring == ROM::SINGLESCREEN_MIRRORING2) {
 
@@ -284,9 +319,10 @@ void PPU::setMirroring(int mirroring) {
 		ntable1[2] = 1;
 		ntable1[3] = 1;
 
-		defineMirrorRegion(0x2400, 0x2400, 0x400);
-		defineMirrorRegion(0x2800, 0x2400, 0x400);
-		defineMirrorRegion(0x2c00, 0x2400, 0x400);
+		nametablePages[0] = 0x2000;
+		nametablePages[1] = 0x2400;
+		nametablePages[2] = 0x2400;
+		nametablePages[3] = 0x2400;
 
 	} else {
 
@@ -297,26 +333,43 @@ void PPU::setMirroring(int mirroring) {
 		ntable1[2] = 2;
 		ntable1[3] = 3;
 
+		nametablePages[0] = 0x2000;
+		nametablePages[1] = 0x2400;
+		nametablePages[2] = 0x2800;
+		nametablePages[3] = 0x2c00;
+
 	}
 
 }
 
 
-// Define a mirrored area in the address lookup table.
-// Assumes the regions don't overlap.
-// The 'to' region is the region that is physically in memory.
-void PPU::defineMirrorRegion(size_t fromStart, size_t toStart, size_t size) {
-	for(size_t i = 0; i < size; ++i) {
-		vramMirrorTable[fromStart + i] = toStart + i;
+// Returns the address that is physically in memory for an address.
+// Mirrors are only followed once, so 0x3000-0x3EFF goes to 0x2000-0x2EFF
+// without the nametable mirroring:
+int PPU::mirrorAddress(int address) {
+	if(address >= 0x4000) {
+		// Mirror of 0x0000-0x3FFF:
+		return address - 0x4000;
+	} else if(address >= 0x3f20) {
+		// Palette mirroring, in 0x3F20, 0x3F40, 0x3F80 and 0x3FC0:
+		if(((0x56 >> ((address >> 5) & 7)) & 1) != 0) {
+			return 0x3f00 | (address & 0x1f);
+		}
+	} else if(address >= 0x3000 && address < 0x3f00) {
+		// Mirror of 0x2000-0x2EFF:
+		return address - 0x1000;
+	} else if(address >= 0x2000 && address < 0x3000) {
+		// Nametable mirroring:
+		return nametablePages[(address >> 10) & 3] | (address & 0x3ff);
 	}
+	return address;
 }
 
 // Emulates PPU cycles
 bool PPU::emulateCycles() {
 	bool did_render = false;
 
-	//int n = (!requestEndFrame && curX+cycles<341 && (scanline-20 < spr0HitY || scanline-22 > spr0HitY))?cycles:1;
-	for(; cycles > 0; --cycles) {
+	while(cycles > 0) {
 
 		if(scanline - 21 == spr0HitY) {
 
@@ -336,7 +389,10 @@ bool PPU::emulateCycles() {
 			}
 		}
 
-		++curX;
+		// Skip ahead to the next thing that happens:
+		int n = std::min(cycles, cyclesToNextEvent());
+		cycles -= n;
+		curX += n;
 		if(curX == 341) {
 
 			curX = 0;
@@ -346,6 +402,20 @@ bool PPU::emulateCycles() {
 	return did_render;
 }
 
+// Returns how many cycles can run before anything happens. That is the end
+// of the line, or the dot sprite 0 is predicted to hit on:
+int PPU::cyclesToNextEvent() {
+	if(requestEndFrame) {
+		return 1;
+	}
+
+	int n = 341 - curX;
+	if(scanline - 21 == spr0HitY && spr0HitX > curX) {
+		n = std::min(n, spr0HitX - curX);
+	}
+	return n;
+}
+
 void PPU::startVBlank() {
 	// Start VBlank period:
 
@@ -361,19 +431,34 @@ void PPU::startVBlank() {
 
 	nes->papu->writeBuffer();
 
-	// Actually draw the screen
-	const SDL_Rect rect = { UNDER_SCAN, UNDER_SCAN, 256-(UNDER_SCAN*2), 240-(UNDER_SCAN*2) };
-	SDL_UpdateTexture(Globals::g_screen, &rect, &_screen_buffer[0], 256 * sizeof(uint32_t));
+	// Hand the screen to the presenter
+	uint64_t timing = FrameTiming::start();
+	if(isSkippingFrame) {
+		// Nothing was drawn, so the last frame stays up
+	} else if(pipeline) {
+		// The worker hands it over once it has drawn it:
+		array<uint32_t, 256> colors;
+		for(size_t i = 0; i < colors.size(); ++i) {
+			colors[i] = screenColor(static_cast<uint8_t>(i));
+		}
+		pipeline->record(PpuPipeline::CMD_END_FRAME, colors);
+		pipeline->submit();
 
-	SDL_RenderClear(Globals::g_renderer);
-	SDL_RenderCopy(Globals::g_renderer, Globals::g_screen, nullptr, nullptr);
-	SDL_RenderPresent(Globals::g_renderer);
+		// The last frame is done, as submit waited for it
+		Presenter::draw_ready();
+	} else {
+		Presenter::Frame& frame = Presenter::back_frame();
+		std::copy(renderer->screen.begin(), renderer->screen.end(), frame.indexes.begin());
+		for(size_t i = 0; i < frame.colors.size(); ++i) {
+			frame.colors[i] = screenColor(static_cast<uint8_t>(i));
+		}
+		Presenter::publish();
+	}
+	FrameTiming::stop(FrameTiming::PHASE_PRESENT, timing);
 
 	// Reset scanline counter:
 	lastRenderedScanline = -1;
 
-	startFrame();
-
 	// Check for key presses
 	nes->_joy1->poll_for_key_events();
 	//nes->_joy2->poll_for_key_events();
@@ -386,7 +471,35 @@ void PPU::startVBlank() {
 			case SDL_QUIT:
 				nes->cpu->stopRunning = true;
 				break;
+			case SDL_KEYDOWN:
+				// Dump the CPU trace on demand
+				if (event.key.keysym.scancode == SDL_SCANCODE_F12 && nes->cpu->trace) {
+					nes->cpu->trace->dump(CpuTrace::DEFAULT_FILE);
+				}
+				// Write a snapshot on demand, once the frame is done
+				if (event.key.keysym.scancode == SDL_SCANCODE_F5) {
+					nes->_is_snapshot_wanted = true;
+				}
+				break;
 #endif
+			// The mouse is the zapper. The window is the size of the screen
+			case SDL_MOUSEBUTTONDOWN:
+			case SDL_MOUSEBUTTONUP:
+				if (event.button.button == SDL_BUTTON_LEFT) {
+					nes->memMapper->setMouseState(
+						event.type == SDL_MOUSEBUTTONDOWN,
+						std::min(std::max(event.button.x, 0), 255),
+						std::min(std::max(event.button.y, 0), 239)
+					);
+				}
+				break;
+			case SDL_MOUSEMOTION:
+				nes->memMapper->setMouseState(
+					(event.motion.state & SDL_BUTTON_LMASK) != 0,
+					std::min(std::max(event.motion.x, 0), 255),
+					std::min(std::max(event.motion.y, 0), 239)
+				);
+				break;
 			case SDL_JOYDEVICEADDED:
 				if (event.jdevice.which > -1) {
 					int id = event.jdevice.which;
@@ -419,18 +532,25 @@ void PPU::startVBlank() {
 		}
 	}
 
+	// Start the next frame after the events, so the frame the zapper is first
+	// fired in is already drawn inline:
+	startFrame();
+
 	// Figure out how much time we spent, and how much we have left
 	gettimeofday(&_frame_end, nullptr);
 	double e = _frame_end.tv_usec + (_frame_end.tv_sec * 1000000.0);
 	double s = _frame_start.tv_usec + (_frame_start.tv_sec * 1000000.0);
 	double diff = e - s;
 
-	// Sleep if there is still time left over, after drawing this frame
+	// Sleep if there is still time left over, after drawing this frame. Frame
+	// skipping is for fast forwarding, so it runs as fast as it can instead
 	double wait = 0;
-	if(diff < Globals::MS_PER_FRAME) {
+	if(diff < Globals::MS_PER_FRAME && Globals::frameSkip <= 1) {
 		wait = Globals::MS_PER_FRAME - diff;
 #ifdef DESKTOP
+		timing = FrameTiming::start();
 		SDL_Delay(wait / 1000.0f);
+		FrameTiming::stop(FrameTiming::PHASE_SLEEP, timing);
 #endif
 	}
 
@@ -443,6 +563,8 @@ void PPU::startVBlank() {
 	}
 	++frameCounter;
 
+	FrameTiming::end_frame();
+
 	// Get the start time of the next frame
 	gettimeofday(&_frame_start, nullptr);
 }
@@ -471,8 +593,9 @@ void PPU::endScanline() {
 		// Clear VBlank flag:
 		setStatusFlag(STATUS_VBLANK, false);
 
-		// Clear Sprite #0 hit flag:
+		// Clear Sprite #0 hit and sprite overflow flags:
 		setStatusFlag(STATUS_SPRITE0HIT, false);
+		setStatusFlag(STATUS_SLSPRITECOUNT, false);
 		hitSpr0 = false;
 		spr0HitX = -1;
 		spr0HitY = -1;
@@ -488,7 +611,7 @@ void PPU::endScanline() {
 
 			if(f_bgVisibility == 1) {
 				// Render dummy scanline:
-				renderBgScanline(&_screen_buffer, 0);
+				renderBgScanline(true, 0);
 			}
 
 		}
@@ -514,13 +637,13 @@ void PPU::endScanline() {
 				// update scroll:
 				cntHT = regHT;
 				cntH = regH;
-				renderBgScanline(&bgbuffer, scanline + 1 - 21);
+				renderBgScanline(false, scanline + 1 - 21);
 			}
 			scanlineAlreadyRendered = false;
 
 			// Check for sprite 0 (next scanline):
 			if(!hitSpr0 && f_spVisibility == 1) {
-				if(sprX[0] >= -7 && sprX[0] < 256 && sprY[0] + 1 <= (scanline - vblankAdd + 1 - 21) && (sprY[0] + 1 + (f_spriteSize == 0 ? 8 : 16)) >= (scanline - vblankAdd + 1 - 21)) {
+				if(spr.sprX[0] >= -7 && spr.sprX[0] < 256 && spr.sprY[0] + 1 <= (scanline - vblankAdd + 1 - 21) && (spr.sprY[0] + 1 + (f_spriteSize == 0 ? 8 : 16)) >= (scanline - vblankAdd + 1 - 21)) {
 					if(checkSprite0(scanline + vblankAdd + 1 - 21)) {
 						////System.out.println("found spr0. curscan="+scanline+" hitscan="+spr0HitY);
 						hitSpr0 = true;
@@ -531,6 +654,15 @@ void PPU::endScanline() {
 		}
 
 		if(f_bgVisibility == 1 || f_spVisibility == 1) {
+			// Set the sprite overflow flag if the next line has more than 8 sprites:
+			int line = scanline - vblankAdd + 1 - 21;
+			if(line >= 0 && line < 240) {
+				updateSpriteLines();
+				if(__builtin_popcountll(spr.spriteLines[line]) > 8) {
+					setStatusFlag(STATUS_SLSPRITECOUNT, true);
+				}
+			}
+
 			// Clock mapper IRQ Counter:
 			nes->memMapper->clockIrqCounter();
 		}
@@ -555,75 +687,61 @@ void PPU::endScanline() {
 }
 
 void PPU::startFrame() {
+	// The zapper looks for light in the frame as it is drawn, which the
+	// worker can't give it. So draw inline from now on:
+	if(pipeline && nes->memMapper->zapperUsed) {
+		stopPipeline();
+		renderer->invalidateLines();
+	}
+
+	// Start the frame with only the current emphasis:
+	emphSlotCount = 0;
+	setEmphasisSlot(nes->palTable->currentEmph & 7);
+	selectPalettes();
+
 	// Set background color:
-	int bgColor = 0;
+	uint8_t bgColor = COLOR_BLACK;
 
 	if(f_dispType == 0) {
 
 		// Color display.
 		// f_color determines color emphasis.
 		// Use first entry of image palette as BG color.
-		bgColor = imgPalette[0];
+		bgColor = (*imgPalette)[0];
 
 	} else {
 
 		// Monochrome display.
-		// f_color determines the bg color.
-		switch (f_color) {
-
-			case 0: {
-				// Black
-				bgColor = 0x00000;
-				break;
-			}
-			case 1: {
-				// Green
-				bgColor = 0x00FF00;
-			}
-			case 2: {
-				// Blue
-				bgColor = 0xFF0000;
-			}
-			case 3: {
-				// Invalid. Use black.
-				bgColor = 0x000000;
-			}
-			case 4: {
-				// Red
-				bgColor = 0x0000FF;
-			}
-			default: {
-				// Invalid. Use black.
-				bgColor = 0x0;
-			}
-		}
+		// The f_color BG colors all fell through to black.
+		bgColor = COLOR_BLACK;
 
 	}
 
-	std::fill(_screen_buffer.begin(), _screen_buffer.end(), bgColor);
-	std::fill(pixrendered.begin(), pixrendered.end(), 65);
+	// Only draw 1 of every Globals::frameSkip frames:
+	skippedFrames = (skippedFrames + 1) % std::max(Globals::frameSkip, 1);
+	isSkippingFrame = skippedFrames != 0;
+
+	if(isSkippingFrame) {
+		// Nothing to draw on
+	} else if(pipeline) {
+		recordChanges();
+		pipeline->record(PpuPipeline::CMD_START_FRAME, bgColor);
+	} else {
+		renderer->startFrame(bgColor);
+	}
+	spr0DrawnTo = -1;
 }
 
 void PPU::endFrame() {
 	// Draw spr#0 hit coordinates:
-	if(showSpr0Hit) {
-		// Spr 0 position:
-		if(sprX[0] >= 0 && sprX[0] < 256 && sprY[0] >= 0 && sprY[0] < 240) {
-			for(size_t i = 0; i < 256; ++i) {
-				_screen_buffer[(sprY[0] << 8) + i] = 0xFF5555;
-			}
-			for(size_t i = 0; i < 240; ++i) {
-				_screen_buffer[(i << 8) + sprX[0]] = 0xFF5555;
-			}
-		}
-		// Hit position:
-		if(spr0HitX >= 0 && spr0HitX < 256 && spr0HitY >= 0 && spr0HitY < 240) {
-			for(size_t i = 0; i < 256; ++i) {
-				_screen_buffer[(spr0HitY << 8) + i] = 0x55FF55;
-			}
-			for(size_t i = 0; i < 240; ++i) {
-				_screen_buffer[(i << 8) + spr0HitX] = 0x55FF55;
-			}
+	if(showSpr0Hit && !isSkippingFrame) {
+		// Spr 0 position, and hit position:
+		if(pipeline) {
+			pipeline->record(PpuPipeline::CMD_CROSSHAIR, PpuPipeline::Crosshair{spr.sprX[0], spr.sprY[0], COLOR_SPR0});
+			pipeline->record(PpuPipeline::CMD_CROSSHAIR, PpuPipeline::Crosshair{spr0HitX, spr0HitY, COLOR_SPR0_HIT});
+		} else {
+			renderer->drawCrosshair(spr.sprX[0], spr.sprY[0], COLOR_SPR0);
+			renderer->drawCrosshair(spr0HitX, spr0HitY, COLOR_SPR0_HIT);
 		}
 	}
 }
@@ -656,7 +774,8 @@ void PPU::updateControlReg2(int value) {
 	if(f_dispType == 0) {
 		nes->palTable->setEmphasis(f_color);
 	}
-	updatePalettes();
+	setEmphasisSlot(nes->palTable->currentEmph & 7);
+	selectPalettes();
 }
 
 void PPU::setStatusFlag(int flag, bool value) {
@@ -670,7 +789,7 @@ void PPU::setStatusFlag(int flag, bool value) {
 // CPU Register $2002:
 // Read the Status Register.
 uint16_t PPU::readStatusRegister() {
-	tmp = nes->getCpuMemory()->load(0x2002);
+	uint16_t tmp = nes->getCpuMemory()->load(0x2002);
 
 	// Reset scroll & VRAM Address toggle:
 	firstWrite = true;
@@ -815,17 +934,24 @@ uint16_t PPU::vramLoad() {
 // CPU Register $2007(W):
 // Write to PPU memory. The address should be set first.
 void PPU::vramWrite(uint16_t value) {
-	triggerRendering();
 	cntsToAddress();
 	regsToAddress();
 
+	// A palette entry written with the color it already has changes
+	// nothing, so the frame does not have to be drawn up to here:
+	if(!isPaletteUnchanged(vramAddress, value)) {
+		triggerRendering();
+	}
+
 	if(vramAddress >= 0x2000) {
 		// Mirroring is used.
 		mirroredWrite(vramAddress, value);
 	} else {
 
-		// Write normally.
-		writeMem(vramAddress, value);
+		// Write normally. The tile is decoded once the writes move
+		// on to another one, so uploads decode each tile once:
+		ppuMem->write(vramAddress, value);
+		deferPatternWrite(vramAddress);
 
 		// Invoke mapper latch:
 		nes->memMapper->latchAccess(vramAddress);
@@ -842,21 +968,18 @@ void PPU::vramWrite(uint16_t value) {
 // Write 256 bytes of main memory
 // into Sprite RAM.
 void PPU::sramDMA(uint16_t value) {
-	shared_ptr<Memory> cpuMem = nes->getCpuMemory();
+	// Copy it all, then decode the sprites in one pass:
+	vector<uint16_t>& cpuMem = nes->cpuMem->mem;
 	int baseAddress = value * 0x100;
-	uint16_t data;
-	for(size_t i = sramAddress; i < 256; ++i) {
-		data = cpuMem->load(baseAddress + i);
-		sprMem->write(i, data);
-		spriteRamWriteUpdate(i, data);
-	}
+	std::copy(cpuMem.begin() + baseAddress + sramAddress, cpuMem.begin() + baseAddress + 256, sprMem->mem.begin() + sramAddress);
+	spriteRamUpdate(sramAddress, 256 - sramAddress);
 
 	nes->getCpu()->haltCycles(513);
 }
 
 // Updates the scroll registers from a new VRAM address.
 void PPU::regsFromAddress() {
-	address = (vramTmpAddress >> 8) & 0xFF;
+	int address = (vramTmpAddress >> 8) & 0xFF;
 	regFV = (address >> 4) & 7;
 	regV = (address >> 3) & 1;
 	regH = (address >> 2) & 1;
@@ -869,7 +992,7 @@ void PPU::regsFromAddress() {
 
 // Updates the scroll registers from a new VRAM address.
 void PPU::cntsFromAddress() {
-	address = (vramAddress >> 8) & 0xFF;
+	int address = (vramAddress >> 8) & 0xFF;
 	cntFV = (address >> 4) & 3;
 	cntV = (address >> 3) & 1;
 	cntH = (address >> 2) & 1;
@@ -881,31 +1004,31 @@ void PPU::cntsFromAddress() {
 }
 
 void PPU::regsToAddress() {
-	b1 = (regFV & 7) << 4;
+	int b1 = (regFV & 7) << 4;
 	b1 |= (regV & 1) << 3;
 	b1 |= (regH & 1) << 2;
 	b1 |= (regVT >> 3) & 3;
 
-	b2 = (regVT & 7) << 5;
+	int b2 = (regVT & 7) << 5;
 	b2 |= regHT & 31;
 
 	vramTmpAddress = ((b1 << 8) | b2) & 0x7FFF;
 }
 
 void PPU::cntsToAddress() {
-	b1 = (cntFV & 7) << 4;
+	int b1 = (cntFV & 7) << 4;
 	b1 |= (cntV & 1) << 3;
 	b1 |= (cntH & 1) << 2;
 	b1 |= (cntVT >> 3) & 3;
 
-	b2 = (cntVT & 7) << 5;
+	int b2 = (cntVT & 7) << 5;
 	b2 |= cntHT & 31;
 
 	vramAddress = ((b1 << 8) | b2) & 0x7FFF;
 }
 
 void PPU::incTileCounter(int count) {
-	for(i = count; i != 0; --i) {
+	for(int i = count; i != 0; --i) {
 		++cntHT;
 		if(cntHT == 32) {
 			cntHT = 0;
@@ -929,7 +1052,7 @@ void PPU::incTileCounter(int count) {
 // Reads from memory, taking into account
 // mirroring/mapping of address ranges.
 uint16_t PPU::mirroredLoad(int address) {
-	return ppuMem->load(vramMirrorTable[address]);
+	return ppuMem->load(mirrorAddress(address));
 }
 
 // Writes to memory, taking into account
@@ -967,9 +1090,9 @@ void PPU::mirroredWrite(int address, uint16_t value) {
 
 	} else {
 
-		// Use lookup table for mirrored address:
-		if(address < static_cast<int>(vramMirrorTable.size())) {
-			writeMem(vramMirrorTable[address], value);
+		// Write to the mirrored address:
+		if(address < 0x8000) {
+			writeMem(mirrorAddress(address), value);
 		} else {
 			//System.out.println("Invalid VRAM address: "+Misc.hex16(address));
 			nes->getCpu()->setCrashed(true);
@@ -990,21 +1113,30 @@ void PPU::triggerRendering() {
 }
 
 void PPU::renderFramePartially(int startScan, int scanCount) {
+	decodePendingTile();
+
+	// When the frame is skipped only sprite 0 is tracked, for sprite 0 hits:
+	if(isSkippingFrame) {
+		if(f_spVisibility == 1 && !Globals::disableSprites) {
+			markSpr0Drawn(startScan, scanCount);
+		}
+		validTileData = false;
+		return;
+	}
+
+	ChromeTrace::begin("renderFramePartially", "start", startScan, "count", scanCount);
 	if(f_spVisibility == 1 && !Globals::disableSprites) {
 		renderSpritesPartially(startScan, scanCount, true);
 	}
 
 	if(f_bgVisibility == 1) {
-		si = startScan << 8;
-		ei = (startScan + scanCount) << 8;
-		if(ei > 0xF000) {
-			ei = 0xF000;
-		}
-		for(destIndex = si; destIndex < ei; ++destIndex) {
-			if(pixrendered[destIndex] > 0xFF) {
-				_screen_buffer[destIndex] = bgbuffer[destIndex];
-			}
+		uint64_t timing = FrameTiming::start();
+		if(pipeline) {
+			pipeline->record(PpuPipeline::CMD_MERGE_BG, PpuPipeline::MergeBg{startScan, scanCount});
+		} else {
+			renderer->mergeBg(startScan, scanCount);
 		}
+		FrameTiming::stop(FrameTiming::PHASE_BACKGROUND, timing);
 	}
 
 	if(f_spVisibility == 1 && !Globals::disableSprites) {
@@ -1012,66 +1144,28 @@ void PPU::renderFramePartially(int startScan, int scanCount) {
 	}
 
 	validTileData = false;
+	ChromeTrace::end("renderFramePartially");
 }
 
-void PPU::renderBgScanline(array<int, 256 * 240>* buffer, int scan) {
-	baseTile = (regS == 0 ? 0 : 256);
-	destIndex = (scan << 8) - regFH;
-	curNt = ntable1[cntV + cntV + cntH];
+void PPU::renderBgScanline(bool toScreen, int scan) {
+	decodePendingTile();
+	uint64_t timing = FrameTiming::start();
+	ChromeTrace::begin("renderBgScanline", "scan", scan);
+	int baseTile = (regS == 0 ? 0 : 256);
 
 	cntHT = regHT;
 	cntH = regH;
-	curNt = ntable1[cntV + cntV + cntH];
+	int curNt = ntable1[cntV + cntV + cntH];
+	bgLine.scan = -1;
 
 	if(scan < 240 && (scan - cntFV) >= 0) {
 
-		tscanoffset = cntFV << 3;
-		y = scan - cntFV;
-		for(tile = 0; tile < 32; ++tile) {
-
-			if(scan >= 0) {
-
-				// Fetch tile & attrib data:
-				if(validTileData) {
-					// Get data from array:
-					t = scantile[tile];
-					tpix = &t->pix;
-					att = attrib[tile];
-				} else {
-					// Fetch data:
-					t = &(ptTile[baseTile + nameTable[curNt].getTileIndex(cntHT, cntVT)]);
-					tpix = &t->pix;
-					att = nameTable[curNt].getAttrib(cntHT, cntVT);
-					scantile[tile] = t;
-					attrib[tile] = att;
-				}
-
-				// Render tile scanline:
-				sx = 0;
-				x = (tile << 3) - regFH;
-				if(x > -8) {
-					if(x < 0) {
-						destIndex -= x;
-						sx = -x;
-					}
-					if(t->opaque[cntFV]) {
-						for(; sx < 8; ++sx) {
-							(*buffer)[destIndex] = imgPalette[(*tpix)[tscanoffset + sx] + att];
-							pixrendered[destIndex] |= 256;
-							++destIndex;
-						}
-					} else {
-						for(; sx < 8; ++sx) {
-							col = (*tpix)[tscanoffset + sx];
-							if(col != 0) {
-								(*buffer)[destIndex] = imgPalette[col + att];
-								pixrendered[destIndex] |= 256;
-							}
-							++destIndex;
-						}
-					}
-				}
+		for(int tile = 0; tile < 32; ++tile) {
 
+			// Fetch tile & attrib data, unless the last line's is still valid:
+			if(!validTileData) {
+				bgLine.tiles[tile] = static_cast<uint16_t>(baseTile + nameTable[curNt].getTileIndex(cntHT, cntVT));
+				bgLine.attribs[tile] = static_cast<uint8_t>(nameTable[curNt].getAttrib(cntHT, cntVT));
 			}
 
 			// Increase Horizontal Tile Counter:
@@ -1086,6 +1180,20 @@ void PPU::renderBgScanline(array<int, 256 * 240>* buffer, int scan) {
 
 		}
 
+		// Render tile scanline:
+		bgLine.scan = scan;
+		bgLine.fineX = regFH;
+		bgLine.fineY = cntFV;
+		bgLine.toScreen = toScreen;
+		if(isSkippingFrame) {
+			// Only fetched, for sprite 0 hits
+		} else if(pipeline) {
+			recordChanges();
+			pipeline->record(PpuPipeline::CMD_BG_LINE, bgLine);
+		} else {
+			renderer->drawBgLine(bgLine);
+		}
+
 		// Tile data for one row should now have been fetched,
 		// so the data in the array is valid.
 		validTileData = true;
@@ -1110,217 +1218,214 @@ void PPU::renderBgScanline(array<int, 256 * 240>* buffer, int scan) {
 		validTileData = false;
 
 	}
-}
-
-void PPU::renderSpritesPartially(int startscan, int scancount, bool bgPri) {
-	if(f_spVisibility == 1) {
 
-		for(size_t i = 0; i < 64; ++i) {
-			if(bgPriority[i] == bgPri && sprX[i] >= 0 && sprX[i] < 256 && sprY[i] + 8 >= startscan && sprY[i] < startscan + scancount) {
-				// Show sprite.
-				if(f_spriteSize == 0) {
-					// 8x8 sprites
+	ChromeTrace::end("renderBgScanline");
+	FrameTiming::stop(FrameTiming::PHASE_BACKGROUND, timing);
+}
 
-					srcy1 = 0;
-					srcy2 = 8;
+// Rebuilds the sprites on each line, if a sprite moved or the sprite size
+// changed. Sprites are drawn one line below their Y coordinate:
+void PPU::updateSpriteLines() {
+	int height = f_spriteSize == 0 ? 8 : 16;
+	if(!spriteLinesDirty && spriteLinesHeight == height) {
+		return;
+	}
 
-					if(sprY[i] < startscan) {
-						srcy1 = startscan - sprY[i] - 1;
-					}
+	spr.spriteLines.fill(0);
+	for(size_t i = 0; i < 64; ++i) {
+		int end = std::min(spr.sprY[i] + height, static_cast<int>(spr.spriteLines.size()) - 1);
+		for(int line = spr.sprY[i] + 1; line <= end; ++line) {
+			spr.spriteLines[line] |= uint64_t(1) << i;
+		}
+	}
+	spriteLinesDirty = false;
+	spriteLinesHeight = height;
+	changedSprites = true;
+}
 
-					if(sprY[i] + 8 > startscan + scancount) {
-						srcy2 = startscan + scancount - sprY[i] + 1;
-					}
+void PPU::renderSpritesPartially(int startscan, int scancount, bool bgPri) {
+	uint64_t timing = FrameTiming::start();
+	ChromeTrace::begin("renderSpritesPartially", "start", startscan, "count", scancount);
+	if(f_spVisibility == 1) {
+		updateSpriteLines();
+		if(pipeline) {
+			recordChanges();
+			pipeline->record(PpuPipeline::CMD_SPRITES, PpuPipeline::DrawSprites{startscan, scancount, bgPri, f_spriteSize, f_spPatternTable});
+			if(spr.bgPriority[0] == bgPri) {
+				markSpr0Drawn(startscan, scancount);
+			}
+		} else {
+			renderer->drawSprites(startscan, scancount, bgPri, f_spriteSize, f_spPatternTable);
+		}
+	}
+	ChromeTrace::end("renderSpritesPartially");
+	FrameTiming::stop(FrameTiming::PHASE_SPRITES, timing);
+}
 
-					if(f_spPatternTable == 0) {
-						ptTile[sprTile[i]].render(0, srcy1, 8, srcy2, sprX[i], sprY[i] + 1, &_screen_buffer, sprCol[i], &sprPalette, horiFlip[i], vertFlip[i], i, &pixrendered);
-					} else {
-						ptTile[sprTile[i] + 256].render(0, srcy1, 8, srcy2, sprX[i], sprY[i] + 1, &_screen_buffer, sprCol[i], &sprPalette, horiFlip[i], vertFlip[i], i, &pixrendered);
-					}
-				} else {
-					// 8x16 sprites
-					int top = sprTile[i];
-					if((top & 1) != 0) {
-						top = sprTile[i] - 1 + 256;
-					}
+// Remembers the last line sprite 0 will be drawn on, for sprite 0 hits
+// on frames that are not drawn here:
+void PPU::markSpr0Drawn(int startscan, int scancount) {
+	int height = f_spriteSize == 0 ? 8 : 16;
+	int endscan = std::min(startscan + scancount, static_cast<int>(spr.spriteLines.size()) - 1);
+	if(spr.sprY[0] + 1 <= endscan && spr.sprY[0] + height >= startscan) {
+		int last = std::min(spr.sprY[0] + height, startscan + scancount + (f_spriteSize == 0 ? 1 : 0));
+		spr0DrawnTo = std::max(spr0DrawnTo, last);
+	}
+}
 
-					srcy1 = 0;
-					srcy2 = 8;
+// Records the tiles, palettes and sprites that changed since the last
+// drawing was recorded, so the worker draws from the same data:
+void PPU::recordChanges() {
+	decodePendingTile();
+	for(size_t i = 0; i < changedTiles.size(); ++i) {
+		while(changedTiles[i] != 0) {
+			size_t index = (i << 6) + __builtin_ctzll(changedTiles[i]);
+			changedTiles[i] &= changedTiles[i] - 1;
+			PpuPipeline::TileData data;
+			data.index = static_cast<uint16_t>(index);
+			data.pix = ptTile[index].pix;
+			pipeline->record(PpuPipeline::CMD_TILE, data);
+		}
+	}
 
-					if(sprY[i] < startscan) {
-						srcy1 = startscan - sprY[i] - 1;
-					}
+	if(changedPalettes) {
+		pipeline->record(PpuPipeline::CMD_PALETTES, PpuPipeline::Palettes{*imgPalette, *sprPalette});
+		changedPalettes = false;
+	}
 
-					if(sprY[i] + 8 > startscan + scancount) {
-						srcy2 = startscan + scancount - sprY[i];
-					}
+	if(changedSprites) {
+		pipeline->record(PpuPipeline::CMD_SPRITE_DATA, spr);
+		changedSprites = false;
+	}
+}
 
-					ptTile[top + (vertFlip[i] ? 1 : 0)].render(0, srcy1, 8, srcy2, sprX[i], sprY[i] + 1, &_screen_buffer, sprCol[i], &sprPalette, horiFlip[i], vertFlip[i], i, &pixrendered);
+// Marks tiles that have changed, so the renderer does not reuse lines drawn
+// with them. When pipelined they are recorded again for the worker instead:
+void PPU::tilesChanged(size_t first, size_t count) {
+	// A pending tile that was replaced whole has nothing left to decode:
+	if(pendingTile >= static_cast<int>(first) && pendingTile < static_cast<int>(first + count)) {
+		pendingTile = -1;
+		pendingRows = 0;
+	}
 
-					srcy1 = 0;
-					srcy2 = 8;
+	for(size_t i = first; i < first + count; ++i) {
+		if(pipeline) {
+			changedTiles[i >> 6] |= uint64_t(1) << (i & 63);
+		} else {
+			renderer->tileChanged(i);
+		}
+	}
+}
 
-					if(sprY[i] + 8 < startscan) {
-						srcy1 = startscan - (sprY[i] + 8 + 1);
-					}
+void PPU::stopPipeline() {
+	if(pipeline) {
+		pipeline->stop();
+		pipeline = nullptr;
+	}
+}
 
-					if(sprY[i] + 16 > startscan + scancount) {
-						srcy2 = startscan + scancount - (sprY[i] + 8);
-					}
+// Returns the pixels x to x + 7 of this line that pixrendered is set for,
+// with pixel x in the top bit. When pipelined or skipping the frame nothing is
+// drawn here, so it is worked out from what was fetched. Only the pixels sprite 0 was drawn on,
+// without a background pixel, are clear:
+uint8_t PPU::renderedMask(int scan, int x) {
+	if(scan < 0 || scan >= 240) {
+		return 0;
+	}
 
-					ptTile[top + (vertFlip[i] ? 0 : 1)].render(0, srcy1, 8, srcy2, sprX[i], sprY[i] + 1 + 8, &_screen_buffer, sprCol[i], &sprPalette, horiFlip[i], vertFlip[i], i, &pixrendered);
+	int mask = 0;
+	if(!pipeline && !isSkippingFrame) {
+		for(int i = 0; i < 8; ++i) {
+			mask <<= 1;
+			if(x + i >= 0 && x + i < 256 && renderer->pixrendered[(scan << 8) + x + i] != 0) {
+				mask |= 1;
+			}
+		}
+		return static_cast<uint8_t>(mask);
+	}
 
-				}
+	if(scan > spr0DrawnTo) {
+		mask = 0xFF;
+	} else if(bgLine.scan == scan) {
+		// The background pixels, from the 2 fetched tiles under these 8:
+		int bx = x + bgLine.fineX + 8;
+		int tile = (bx >> 3) - 1;
+		int row = 0;
+		for(int i = tile; i <= tile + 1; ++i) {
+			row <<= 8;
+			if(i >= 0 && i < 32) {
+				row |= ptTile[bgLine.tiles[i]].rowMask[bgLine.fineY];
 			}
 		}
+		mask = (row << (bx & 7)) >> 8;
+	}
+
+	// Pixels off the screen are never rendered:
+	if(x < 0) {
+		mask &= 0xFF >> -x;
+	} else if(x > 248) {
+		mask &= 0xFF << (x - 248);
 	}
+	return static_cast<uint8_t>(mask);
 }
 
+// Checks if sprite 0 hits on this line. The row of the sprite that is on the
+// line is ANDed with the pixels rendered under it, and the first pixel left
+// is where it hits:
 bool PPU::checkSprite0(int scan) {
+	decodePendingTile();
 	spr0HitX = -1;
 	spr0HitY = -1;
 
-	int toffset;
-	int tIndexAdd = (f_spPatternTable == 0 ? 0 : 256);
-	int x, y;
-	int bufferIndex;
-	//int col;
-	//bool bgPri;
-	Tile* t;
-
-	x = sprX[0];
-	y = sprY[0] + 1;
+	int x = spr.sprX[0];
+	int y = spr.sprY[0] + 1;
+	int height = f_spriteSize == 0 ? 8 : 16;
 
+	// Check range:
+	if(y > scan || y + height <= scan || x < -7 || x >= 256) {
+		return false;
+	}
 
+	// Find the sprite row on this line:
+	int row = spr.vertFlip[0] ? height - 1 - (scan - y) : scan - y;
+	Tile* t;
 	if(f_spriteSize == 0) {
-
 		// 8x8 sprites.
-
-		// Check range:
-		if(y <= scan && y + 8 > scan && x >= -7 && x < 256) {
-
-			// Sprite is in range.
-			// Draw scanline:
-			t = &(ptTile[sprTile[0] + tIndexAdd]);
-			//col = sprCol[0];
-			//bgPri = bgPriority[0];
-
-			if(vertFlip[0]) {
-				toffset = 7 - (scan - y);
-			} else {
-				toffset = scan - y;
-			}
-			toffset *= 8;
-
-			bufferIndex = scan * 256 + x;
-			if(horiFlip[0]) {
-				for(int i = 7; i >= 0; --i) {
-					if(x >= 0 && x < 256) {
-						if(bufferIndex >= 0 && bufferIndex < 61440 && pixrendered[bufferIndex] != 0) {
-							if(t->pix[toffset + i] != 0) {
-								spr0HitX = bufferIndex % 256;
-								spr0HitY = scan;
-								return true;
-							}
-						}
-					}
-					++x;
-					++bufferIndex;
-				}
-
-			} else {
-
-				for(size_t i = 0; i < 8; ++i) {
-					if(x >= 0 && x < 256) {
-						if(bufferIndex >= 0 && bufferIndex < 61440 && pixrendered[bufferIndex] != 0) {
-							if(t->pix[toffset + i] != 0) {
-								spr0HitX = bufferIndex % 256;
-								spr0HitY = scan;
-								return true;
-							}
-						}
-					}
-					++x;
-					++bufferIndex;
-				}
-
-			}
-
-		}
-
-
+		t = &(ptTile[spr.sprTile[0] + (f_spPatternTable == 0 ? 0 : 256)]);
+	} else if(row < 8) {
+		// 8x16 sprites, first half of sprite.
+		t = &(ptTile[spr.sprTile[0] + (spr.vertFlip[0] ? 1 : 0) + ((spr.sprTile[0] & 1) != 0 ? 255 : 0)]);
 	} else {
-
-		// 8x16 sprites:
-
-		// Check range:
-		if(y <= scan && y + 16 > scan && x >= -7 && x < 256) {
-
-			// Sprite is in range.
-			// Draw scanline:
-
-			if(vertFlip[0]) {
-				toffset = 15 - (scan - y);
-			} else {
-				toffset = scan - y;
-			}
-
-			if(toffset < 8) {
-				// first half of sprite.
-				t = &(ptTile[sprTile[0] + (vertFlip[0] ? 1 : 0) + ((sprTile[0] & 1) != 0 ? 255 : 0)]);
-			} else {
-				// second half of sprite.
-				t = &(ptTile[sprTile[0] + (vertFlip[0] ? 0 : 1) + ((sprTile[0] & 1) != 0 ? 255 : 0)]);
-				if(vertFlip[0]) {
-					toffset = 15 - toffset;
-				} else {
-					toffset -= 8;
-				}
-			}
-			toffset *= 8;
-			col = sprCol[0];
-			//bgPri = bgPriority[0];
-
-			bufferIndex = scan * 256 + x;
-			if(horiFlip[0]) {
-
-				for(int i = 7; i >= 0; --i) {
-					if(x >= 0 && x < 256) {
-						if(bufferIndex >= 0 && bufferIndex < 61440 && pixrendered[bufferIndex] != 0) {
-							if(t->pix[toffset + i] != 0) {
-								spr0HitX = bufferIndex % 256;
-								spr0HitY = scan;
-								return true;
-							}
-						}
-					}
-					++x;
-					++bufferIndex;
-				}
-
-			} else {
-
-				for(size_t i = 0; i < 8; ++i) {
-					if(x >= 0 && x < 256) {
-						if(bufferIndex >= 0 && bufferIndex < 61440 && pixrendered[bufferIndex] != 0) {
-							if(t->pix[toffset + i] != 0) {
-								spr0HitX = bufferIndex % 256;
-								spr0HitY = scan;
-								return true;
-							}
-						}
-					}
-					++x;
-					++bufferIndex;
-				}
-
-			}
-
+		// 8x16 sprites, second half of sprite.
+		t = &(ptTile[spr.sprTile[0] + (spr.vertFlip[0] ? 0 : 1) + ((spr.sprTile[0] & 1) != 0 ? 255 : 0)]);
+		if(spr.vertFlip[0]) {
+			row = 15 - row;
+		} else {
+			row -= 8;
 		}
+	}
+
+	uint8_t sprite = t->rowMask[row];
+	if(spr.horiFlip[0]) {
+		sprite = reverseBits(sprite);
+	}
 
+	int hit = sprite & renderedMask(scan, x);
+	if(hit == 0) {
+		return false;
 	}
 
-	return false;
+	spr0HitX = x + __builtin_clz(hit) - 24;
+	spr0HitY = scan;
+	return true;
+}
+
+// Returns the bits of a byte in reverse order:
+uint8_t PPU::reverseBits(uint8_t b) {
+	b = static_cast<uint8_t>(((b & 0xF0) >> 4) | ((b & 0x0F) << 4));
+	b = static_cast<uint8_t>(((b & 0xCC) >> 2) | ((b & 0x33) << 2));
+	b = static_cast<uint8_t>(((b & 0xAA) >> 1) | ((b & 0x55) << 1));
+	return b;
 }
 /*
 // Renders the contents of the
@@ -1467,7 +1572,7 @@ void PPU::writeMem(int address, uint16_t value) {
 
 	} else if(address >= 0x3f00 && address < 0x3f20) {
 
-		updatePalettes();
+		updatePaletteEntry(address - 0x3f00, value);
 
 	}
 }
@@ -1475,29 +1580,50 @@ void PPU::writeMem(int address, uint16_t value) {
 // Reads data from $3f00 to $f20
 // into the two buffered palettes.
 void PPU::updatePalettes() {
-	for(size_t i = 0; i < 16; ++i) {
-		if(f_dispType == 0) {
-			imgPalette[i] = nes->palTable->getEntry(ppuMem->load(0x3f00 + i) & 63);
-		} else {
-			imgPalette[i] = nes->palTable->getEntry(ppuMem->load(0x3f00 + i) & 32);
-		}
-	}
-	for(size_t i = 0; i < 16; ++i) {
-		if(f_dispType == 0) {
-			sprPalette[i] = nes->palTable->getEntry(ppuMem->load(0x3f10 + i) & 63);
-		} else {
-			sprPalette[i] = nes->palTable->getEntry(ppuMem->load(0x3f10 + i) & 32);
-		}
+	for(int i = 0; i < 32; ++i) {
+		updatePaletteEntry(i, ppuMem->load(0x3f00 + i));
 	}
 
 //renderPalettes();
 
 }
 
+// Updates one of the 32 palette entries, in every copy of the palettes:
+void PPU::updatePaletteEntry(int index, uint16_t value) {
+	array<array<uint8_t, 16>, 6>& palettes = index < 16 ? imgPalettes : sprPalettes;
+	for(size_t slot = 0; slot < emphSlots.size(); ++slot) {
+		palettes[slot * 2][index & 15] = static_cast<uint8_t>((slot << 6) | (value & 63));
+		palettes[slot * 2 + 1][index & 15] = static_cast<uint8_t>((slot << 6) | (value & 32));
+	}
+	changedPalettes = true;
+}
+
+// Returns if writing this value to this address leaves the palettes as
+// they are. Writes to entry 0 of a palette also go to its mirror:
+bool PPU::isPaletteUnchanged(int address, uint16_t value) {
+	if(address < 0x3f00 || address >= 0x3f20 || ppuMem->load(address) != value) {
+		return false;
+	}
+	return (address & 3) != 0 || ppuMem->load(address ^ 0x10) == value;
+}
+
+// Points the palettes at the copies for the emphasis slot and display type:
+void PPU::selectPalettes() {
+	size_t copy = emphSlot * 2 + (f_dispType == 0 ? 0 : 1);
+	if(imgPalette != &imgPalettes[copy]) {
+		imgPalette = &imgPalettes[copy];
+		sprPalette = &sprPalettes[copy];
+		renderer->imgPalette = imgPalette;
+		renderer->sprPalette = sprPalette;
+		changedPalettes = true;
+	}
+}
+
 
 // Updates the internal pattern
 // table buffers with this new byte.
 void PPU::patternWrite(int address, uint16_t value) {
+	decodePendingTile();
 	int tileIndex = address / 16;
 	int leftOver = address % 16;
 	if(leftOver < 8) {
@@ -1505,11 +1631,13 @@ void PPU::patternWrite(int address, uint16_t value) {
 	} else {
 		ptTile[tileIndex].setScanline(leftOver - 8, ppuMem->load(address - 8), value);
 	}
+	tilesChanged(tileIndex, 1);
 }
 
 void PPU::patternWrite(int address, vector<uint16_t>* value, size_t offset, size_t length) {
 	int tileIndex;
 	int leftOver;
+	decodePendingTile();
 
 	for(size_t i = 0; i < length; ++i) {
 
@@ -1521,8 +1649,39 @@ void PPU::patternWrite(int address, vector<uint16_t>* value, size_t offset, size
 		} else {
 			ptTile[tileIndex].setScanline(leftOver - 8, ppuMem->load(address - 8 + i), (*value)[offset + i]);
 		}
+		tilesChanged(tileIndex, 1);
+
+	}
+}
 
+// Notes a $2007 write to pattern memory, that is already in ppuMem. Its
+// tile is decoded later, so a tile written byte by byte is decoded once:
+void PPU::deferPatternWrite(int address) {
+	int tileIndex = address >> 4;
+	if(tileIndex != pendingTile) {
+		decodePendingTile();
+		pendingTile = tileIndex;
 	}
+	pendingRows |= 1 << (address & 7);
+}
+
+// Decodes the rows written to the pending tile. This has to be done before
+// anything uses the tiles:
+void PPU::decodePendingTile() {
+	if(pendingTile < 0) {
+		return;
+	}
+
+	int tileIndex = pendingTile;
+	int address = tileIndex << 4;
+	for(int row = 0; row < 8; ++row) {
+		if((pendingRows & (1 << row)) != 0) {
+			ptTile[tileIndex].setScanline(row, ppuMem->load(address + row), ppuMem->load(address + row + 8));
+		}
+	}
+	pendingTile = -1;
+	pendingRows = 0;
+	tilesChanged(tileIndex, 1);
 }
 
 void PPU::invalidateFrameCache() {
@@ -1550,35 +1709,62 @@ void PPU::attribTableWrite(int index, int address, uint16_t value) {
 // Updates the internally buffered sprite
 // data with this new byte of info.
 void PPU::spriteRamWriteUpdate(int address, uint16_t value) {
-	int tIndex = address / 4;
+	changedSprites = true;
 
-	if(tIndex == 0) {
+	if(address / 4 == 0) {
 		//updateSpr0Hit();
 		checkSprite0(scanline + 1 - vblankAdd - 21);
 	}
+	decodeSpriteByte(address, value);
+}
+
+// Updates the sprites from bytes already in sprite RAM, like writing them
+// one at a time would. Sprite 0 is only checked before its last byte, as
+// that is the check that counts:
+void PPU::spriteRamUpdate(int first, int count) {
+	changedSprites = true;
+	vector<uint16_t>& mem = sprMem->mem;
+	for(int address = first; address < first + count; ++address) {
+		if(address == 3) {
+			checkSprite0(scanline + 1 - vblankAdd - 21);
+		}
+		decodeSpriteByte(address, mem[address]);
+	}
+}
+
+void PPU::decodeSpriteByte(int address, uint16_t value) {
+	int tIndex = address / 4;
 
 	if(address % 4 == 0) {
 
 		// Y coordinate
-		sprY[tIndex] = value;
+		if(spr.sprY[tIndex] != value) {
+			spr.sprY[tIndex] = value;
+			spriteLinesDirty = true;
+		}
 
 	} else if(address % 4 == 1) {
 
 		// Tile index
-		sprTile[tIndex] = value;
+		spr.sprTile[tIndex] = value;
 
 	} else if(address % 4 == 2) {
 
 		// Attributes
-		vertFlip[tIndex] = ((value & 0x80) != 0);
-		horiFlip[tIndex] = ((value & 0x40) != 0);
-		bgPriority[tIndex] = ((value & 0x20) != 0);
-		sprCol[tIndex] = (value & 3) << 2;
+		spr.vertFlip[tIndex] = ((value & 0x80) != 0);
+		spr.horiFlip[tIndex] = ((value & 0x40) != 0);
+		spr.bgPriority[tIndex] = ((value & 0x20) != 0);
+		if(spr.bgPriority[tIndex]) {
+			spr.spritesBehindBg |= uint64_t(1) << tIndex;
+		} else {
+			spr.spritesBehindBg &= ~(uint64_t(1) << tIndex);
+		}
+		spr.sprCol[tIndex] = (value & 3) << 2;
 
 	} else if(address % 4 == 3) {
 
 		// X coordinate
-		sprX[tIndex] = value;
+		spr.sprX[tIndex] = value;
 
 	}
 }
@@ -1590,6 +1776,8 @@ void PPU::doNMI() {
 	nes->getCpu()->requestIrq(CPU::IRQ_NMI);
 }
 
+// The nametable address takes 2 bits and the color emphasis 3, so the flags
+// after them are moved up to make room:
 int PPU::statusRegsToInt() {
 	int ret = 0;
 	ret = (f_nmiOnVblank) |
@@ -1598,35 +1786,49 @@ int PPU::statusRegsToInt() {
 			(f_spPatternTable << 3) |
 			(f_addrInc << 4) |
 			(f_nTblAddress << 5) |
-			(f_color << 6) |
-			(f_spVisibility << 7) |
-			(f_bgVisibility << 8) |
-			(f_spClipping << 9) |
-			(f_bgClipping << 10) |
-			(f_dispType << 11);
+			(f_color << 7) |
+			(f_spVisibility << 10) |
+			(f_bgVisibility << 11) |
+			(f_spClipping << 12) |
+			(f_bgClipping << 13) |
+			(f_dispType << 14);
 
 	return ret;
 }
 
-void PPU::statusRegsFromInt(int n) {
+void PPU::statusRegsFromInt(int n, int version) {
 	f_nmiOnVblank = (n) & 0x1;
 	f_spriteSize = (n >> 1) & 0x1;
 	f_bgPatternTable = (n >> 2) & 0x1;
 	f_spPatternTable = (n >> 3) & 0x1;
 	f_addrInc = (n >> 4) & 0x1;
-	f_nTblAddress = (n >> 5) & 0x1;
 
-	f_color = (n >> 6) & 0x1;
-	f_spVisibility = (n >> 7) & 0x1;
-	f_bgVisibility = (n >> 8) & 0x1;
-	f_spClipping = (n >> 9) & 0x1;
-	f_bgClipping = (n >> 10) & 0x1;
-	f_dispType = (n >> 11) & 0x1;
+	if(version < 3) {
+		// Before version 3 the fields overlapped, so only the low bit of
+		// the nametable address and of the color emphasis are known:
+		f_nTblAddress = (n >> 5) & 0x1;
+		f_color = (n >> 6) & 0x1;
+		f_spVisibility = (n >> 7) & 0x1;
+		f_bgVisibility = (n >> 8) & 0x1;
+		f_spClipping = (n >> 9) & 0x1;
+		f_bgClipping = (n >> 10) & 0x1;
+		f_dispType = (n >> 11) & 0x1;
+		return;
+	}
+
+	f_nTblAddress = (n >> 5) & 0x3;
+	f_color = (n >> 7) & 0x7;
+	f_spVisibility = (n >> 10) & 0x1;
+	f_bgVisibility = (n >> 11) & 0x1;
+	f_spClipping = (n >> 12) & 0x1;
+	f_bgClipping = (n >> 13) & 0x1;
+	f_dispType = (n >> 14) & 0x1;
 }
 
 void PPU::stateLoad(ByteBuffer* buf) {
 	// Check version:
-	if(buf->readByte() == 1) {
+	int version = buf->readByte();
+	if(version >= 1 && version <= 3) {
 
 		// Counters:
 		cntFV = buf->readInt();
@@ -1652,7 +1854,7 @@ void PPU::stateLoad(ByteBuffer* buf) {
 
 
 		// Control/Status registers:
-		statusRegsFromInt(buf->readInt());
+		statusRegsFromInt(buf->readInt(), version);
 
 
 		// VRAM I/O:
@@ -1664,8 +1866,19 @@ void PPU::stateLoad(ByteBuffer* buf) {
 		// Mirroring:
 		//currentMirroring = -1;
 		//setMirroring(buf->readInt());
-		for(size_t i = 0; i < vramMirrorTable.size(); ++i) {
-			vramMirrorTable[i] = buf->readInt();
+		if(version == 1) {
+			// Version 1 has the whole mirroring lookup table,
+			// where only the nametable pages can differ:
+			for(int i = 0; i < 0x8000; ++i) {
+				int address = buf->readInt();
+				if(i >= 0x2000 && i < 0x3000 && (i & 0x3ff) == 0) {
+					nametablePages[(i >> 10) & 3] = address;
+				}
+			}
+		} else {
+			for(size_t i = 0; i < nametablePages.size(); ++i) {
+				nametablePages[i] = buf->readInt();
+			}
 		}
 
 
@@ -1683,16 +1896,18 @@ void PPU::stateLoad(ByteBuffer* buf) {
 		nmiOk = buf->readBoolean();
 		dummyCycleToggle = buf->readBoolean();
 		nmiCounter = buf->readInt();
-		tmp = static_cast<uint16_t>(buf->readInt());
+		// Was a temporary, that is no longer kept:
+		buf->readInt();
 
 
 		// Stuff used during rendering:
-		for(size_t i = 0; i < bgbuffer.size(); ++i) {
-			bgbuffer[i] = buf->readByte();
+		for(size_t i = 0; i < renderer->bgbuffer.size(); ++i) {
+			renderer->bgbuffer[i] = buf->readByte();
 		}
-		for(size_t i = 0; i < pixrendered.size(); ++i) {
-			pixrendered[i] = buf->readByte();
+		for(size_t i = 0; i < renderer->pixrendered.size(); ++i) {
+			renderer->pixrendered[i] = buf->readByte();
 		}
+		renderer->invalidateLines();
 
 		// Name tables:
 		for(size_t i = 0; i < 4; ++i) {
@@ -1704,6 +1919,7 @@ void PPU::stateLoad(ByteBuffer* buf) {
 		for(size_t i = 0; i < ptTile.size(); ++i) {
 			ptTile[i].stateLoad(buf);
 		}
+		tilesChanged(0, ptTile.size());
 
 		// Update internally stored stuff from VRAM memory:
 		/*vector<uint16_t>* mem = ppuMem.mem;
@@ -1713,17 +1929,25 @@ void PPU::stateLoad(ByteBuffer* buf) {
 		writeMem(i,mem[i]);
 		}
 		*/
-		// Sprite data:
-		vector<uint16_t>* sprmem = &(nes->getSprMemory()->mem);
-		for(size_t i = 0; i < sprmem->size(); ++i) {
-			spriteRamWriteUpdate(i, (*sprmem)[i]);
+		// Color emphasis, as the last write to the control register set it:
+		if(f_dispType == 0) {
+			nes->palTable->setEmphasis(f_color);
 		}
+
+		// Palettes:
+		updatePalettes();
+		selectPalettes();
+
+		// Sprite data:
+		spriteRamUpdate(0, static_cast<int>(sprMem->mem.size()));
 	}
 }
 
 void PPU::stateSave(ByteBuffer* buf) {
+	decodePendingTile();
+
 	// Version:
-	buf->putByte(static_cast<uint16_t>(1));
+	buf->putByte(static_cast<uint16_t>(3));
 
 
 	// Counters:
@@ -1760,8 +1984,8 @@ void PPU::stateSave(ByteBuffer* buf) {
 
 	// Mirroring:
 	//buf->putInt(currentMirroring);
-	for(size_t i = 0; i < vramMirrorTable.size(); ++i) {
-		buf->putInt(vramMirrorTable[i]);
+	for(size_t i = 0; i < nametablePages.size(); ++i) {
+		buf->putInt(nametablePages[i]);
 	}
 
 
@@ -1780,15 +2004,15 @@ void PPU::stateSave(ByteBuffer* buf) {
 	buf->putBoolean(nmiOk);
 	buf->putBoolean(dummyCycleToggle);
 	buf->putInt(nmiCounter);
-	buf->putInt(tmp);
+	buf->putInt(0);
 
 
 	// Stuff used during rendering:
-	for(size_t i = 0; i < bgbuffer.size(); ++i) {
-		buf->putByte(static_cast<uint16_t>(bgbuffer[i]));
+	for(size_t i = 0; i < renderer->bgbuffer.size(); ++i) {
+		buf->putByte(static_cast<uint16_t>(renderer->bgbuffer[i]));
 	}
-	for(size_t i = 0; i < pixrendered.size(); ++i) {
-		buf->putByte(static_cast<uint16_t>(pixrendered[i]));
+	for(size_t i = 0; i < renderer->pixrendered.size(); ++i) {
+		buf->putByte(static_cast<uint16_t>(renderer->pixrendered[i]));
 	}
 
 	// Name tables:
@@ -1808,6 +2032,7 @@ void PPU::stateSave(ByteBuffer* buf) {
 void PPU::reset() {
 	ppuMem->reset();
 	sprMem->reset();
+	updatePalettes();
 
 	vramBufferedReadValue = 0;
 	sramAddress = 0;
@@ -1827,9 +2052,6 @@ void PPU::reset() {
 	dummyCycleToggle = false;
 	validTileData = false;
 	nmiCounter = 0;
-	tmp = 0;
-	att = 0;
-	i = 0;
 
 	// Control Flags Register 1:
 	f_nmiOnVblank = 0;	// NMI on VBlank. 0=disable, 1=enable
@@ -13,6 +13,7 @@ Hosted at: https://github.com/workhorsy/SaltyNES
 int PaletteTable::curTable[64] = {0};
 int PaletteTable::origTable[64] = {0};
 int PaletteTable::emphTable[8][64] = {{0}};
+int PaletteTable::adjTable[8][64] = {{0}};
 
 PaletteTable::PaletteTable() : enable_shared_from_this<PaletteTable>() {
 }
@@ -62,15 +63,16 @@ void PaletteTable::makeTables() {
 			emphTable[emph][i] = getRgb(r, g, b);
 		}
 	}
+
+	updatePalette();
 }
 
 void PaletteTable::setEmphasis(int emph) {
 	if(emph != currentEmph) {
 		currentEmph = emph;
 		for(int i = 0; i < 64; ++i) {
-			curTable[i] = emphTable[emph][i];
+			curTable[i] = adjTable[emph][i];
 		}
-		updatePalette();
 	}
 }
 
@@ -161,66 +163,74 @@ void PaletteTable::updatePalette(int hueAdd, int saturationAdd, int lightnessAdd
 	if(contrastAdd > 0) {
 		contrastAdd *= 4;
 	}
-	for(int i = 0; i < 64; ++i) {
-
-		hsl = RGBtoHSL(emphTable[currentEmph][i]);
-		h = getHue(hsl) + hueAdd;
-		s = static_cast<int>(getSaturation(hsl) * (1.0 + saturationAdd / 256.0f));
-		l = getLightness(hsl);
-
-		if(h < 0) {
-			h += 255;
-		}
-		if(s < 0) {
-			s = 0;
-		}
-		if(l < 0) {
-			l = 0;
-		}
-
-		if(h > 255) {
-			h -= 255;
-		}
-		if(s > 255) {
-			s = 255;
-		}
-		if(l > 255) {
-			l = 255;
-		}
-
-		rgb = HSLtoRGB(h, s, l);
-
-		r = getRed(rgb);
-		g = getGreen(rgb);
-		b = getBlue(rgb);
-
-		r = 128 + lightnessAdd + static_cast<int>((r - 128) * (1.0 + contrastAdd / 256.0f));
-		g = 128 + lightnessAdd + static_cast<int>((g - 128) * (1.0 + contrastAdd / 256.0f));
-		b = 128 + lightnessAdd + static_cast<int>((b - 128) * (1.0 + contrastAdd / 256.0f));
+	// Calculate a table for each emphasis setting:
+	for(int emph = 0; emph < 8; ++emph) {
+		for(int i = 0; i < 64; ++i) {
 
-		if(r < 0) {
-			r = 0;
-		}
-		if(g < 0) {
-			g = 0;
-		}
-		if(b < 0) {
-			b = 0;
-		}
+			hsl = RGBtoHSL(emphTable[emph][i]);
+			h = getHue(hsl) + hueAdd;
+			s = static_cast<int>(getSaturation(hsl) * (1.0 + saturationAdd / 256.0f));
+			l = getLightness(hsl);
+
+			if(h < 0) {
+				h += 255;
+			}
+			if(s < 0) {
+				s = 0;
+			}
+			if(l < 0) {
+				l = 0;
+			}
+
+			if(h > 255) {
+				h -= 255;
+			}
+			if(s > 255) {
+				s = 255;
+			}
+			if(l > 255) {
+				l = 255;
+			}
+
+			rgb = HSLtoRGB(h, s, l);
+
+			r = getRed(rgb);
+			g = getGreen(rgb);
+			b = getBlue(rgb);
+
+			r = 128 + lightnessAdd + static_cast<int>((r - 128) * (1.0 + contrastAdd / 256.0f));
+			g = 128 + lightnessAdd + static_cast<int>((g - 128) * (1.0 + contrastAdd / 256.0f));
+			b = 128 + lightnessAdd + static_cast<int>((b - 128) * (1.0 + contrastAdd / 256.0f));
+
+			if(r < 0) {
+				r = 0;
+			}
+			if(g < 0) {
+				g = 0;
+			}
+			if(b < 0) {
+				b = 0;
+			}
+
+			if(r > 255) {
+				r = 255;
+			}
+			if(g > 255) {
+				g = 255;
+			}
+			if(b > 255) {
+				b = 255;
+			}
+
+			rgb = getRgb(r, g, b);
+			adjTable[emph][i] = rgb;
 
-		if(r > 255) {
-			r = 255;
-		}
-		if(g > 255) {
-			g = 255;
 		}
-		if(b > 255) {
-			b = 255;
+	}
+	if(currentEmph >= 0) {
+		for(int i = 0; i < 64; ++i) {
+			curTable[i] = adjTable[currentEmph][i];
 		}
-
-		rgb = getRgb(r, g, b);
-		curTable[i] = rgb;
-
 	}
 
 	currentHue = hueAdd;
@@ -0,0 +1,156 @@
+/*
+Copyright (c) 2012-2017 Matthew Brennan Jones <matthew.brennan.jones@gmail.com>
+A NES emulator in WebAssembly. Based on vNES.
+Licensed under GPLV3 or later
+Hosted at: https://github.com/workhorsy/SaltyNES
+*/
+
+/*
+This class draws frames on a worker thread, while the CPU runs the next one.
+Instead of drawing, the PPU records what it would draw into a log, along with
+any tiles, palettes and sprites that changed since the last thing recorded.
+At VBlank the log is handed to the worker, which replays it with its own
+renderer and copies of the data, then gives the frame to the presenter.
+Emulation only waits if the worker is still drawing the frame before.
+*/
+
+#include "SaltyNES.h"
+
+// Copies the data after a command out of the log:
+template<typename T>
+static size_t read_data(const vector<uint8_t>& log, size_t pos, T* data) {
+	memcpy(data, &log[pos], sizeof(T));
+	return pos + sizeof(T);
+}
+
+PpuPipeline::PpuPipeline() {
+	_recording.reserve(LOG_SIZE);
+	_replaying.reserve(LOG_SIZE);
+	_is_replaying = false;
+	_stop = false;
+	_img_palette.fill(0);
+	_spr_palette.fill(0);
+	memset(&_sprites, 0, sizeof(_sprites));
+
+	_renderer.tiles = &_tiles;
+	_renderer.imgPalette = &_img_palette;
+	_renderer.sprPalette = &_spr_palette;
+	_renderer.sprites = &_sprites;
+}
+
+PpuPipeline::~PpuPipeline() {
+	stop();
+}
+
+void PpuPipeline::start() {
+	_stop = false;
+	_thread = std::thread(&PpuPipeline::replay_loop, this);
+}
+
+void PpuPipeline::stop() {
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+	_wake.notify_all();
+	if(_thread.joinable()) {
+		_thread.join();
+	}
+}
+
+// Hands the recorded frame to the worker:
+void PpuPipeline::submit() {
+	std::unique_lock<std::mutex> lock(_mutex);
+	_wake.wait(lock, [this] { return !_is_replaying || _stop; });
+	_recording.swap(_replaying);
+	_recording.clear();
+	_is_replaying = true;
+	lock.unlock();
+	_wake.notify_all();
+}
+
+void PpuPipeline::replay_loop() {
+	ChromeTrace::name_thread("ppu renderer");
+
+	std::unique_lock<std::mutex> lock(_mutex);
+	while(true) {
+		_wake.wait(lock, [this] { return _is_replaying || _stop; });
+		if(_stop) {
+			break;
+		}
+
+		lock.unlock();
+		replay(_replaying);
+		lock.lock();
+		_is_replaying = false;
+		_wake.notify_all();
+	}
+}
+
+void PpuPipeline::replay(const vector<uint8_t>& log) {
+	ChromeTrace::begin("replay", "bytes", static_cast<int>(log.size()));
+	size_t pos = 0;
+	while(pos < log.size()) {
+		Command command = static_cast<Command>(log[pos]);
+		++pos;
+
+		switch(command) {
+			case CMD_START_FRAME: {
+				uint8_t bgColor;
+				pos = read_data(log, pos, &bgColor);
+				_renderer.startFrame(bgColor);
+				break;
+			}
+			case CMD_BG_LINE: {
+				PpuRenderer::BgLine line;
+				pos = read_data(log, pos, &line);
+				_renderer.drawBgLine(line);
+				break;
+			}
+			case CMD_MERGE_BG: {
+				MergeBg merge;
+				pos = read_data(log, pos, &merge);
+				_renderer.mergeBg(merge.startScan, merge.scanCount);
+				break;
+			}
+			case CMD_SPRITES: {
+				DrawSprites draw;
+				pos = read_data(log, pos, &draw);
+				_renderer.drawSprites(draw.startscan, draw.scancount, draw.bgPri, draw.spriteSize, draw.patternTable);
+				break;
+			}
+			case CMD_CROSSHAIR: {
+				Crosshair cross;
+				pos = read_data(log, pos, &cross);
+				_renderer.drawCrosshair(cross.x, cross.y, cross.color);
+				break;
+			}
+			case CMD_TILE: {
+				TileData tile;
+				pos = read_data(log, pos, &tile);
+				_tiles[tile.index].pix = tile.pix;
+				_renderer.tileChanged(tile.index);
+				break;
+			}
+			case CMD_PALETTES: {
+				Palettes palettes;
+				pos = read_data(log, pos, &palettes);
+				_img_palette = palettes.img;
+				_spr_palette = palettes.spr;
+				break;
+			}
+			case CMD_SPRITE_DATA: {
+				pos = read_data(log, pos, &_sprites);
+				break;
+			}
+			case CMD_END_FRAME: {
+				Presenter::Frame& frame = Presenter::back_frame();
+				pos = read_data(log, pos, &frame.colors);
+				std::copy(_renderer.screen.begin(), _renderer.screen.end(), frame.indexes.begin());
+				Presenter::hand_off();
+				break;
+			}
+		}
+	}
+	ChromeTrace::end("replay");
+}
@@ -0,0 +1,248 @@
+/*
+Copyright (c) 2012-2017 Matthew Brennan Jones <matthew.brennan.jones@gmail.com>
+Copyright (c) 2006-2011 Jamie Sanders
+A NES emulator in WebAssembly. Based on vNES.
+Licensed under GPLV3 or later
+Hosted at: https://github.com/workhorsy/SaltyNES
+*/
+
+/*
+This class draws the frame for the PPU. It only reads the tiles, palettes and
+sprites it is pointed at, and the background tiles the PPU fetched, so it can
+draw on another thread from copies of them. Background lines stay in bgbuffer
+between frames, so a line fetched with the same tiles, tile contents and
+palette as last time is not drawn again. Only its pixrendered bits are.
+*/
+
+#include "SaltyNES.h"
+
+PpuRenderer::PpuRenderer() {
+	screen.fill(0);
+	bgbuffer.fill(0);
+	pixrendered.fill(0);
+	tiles = nullptr;
+	imgPalette = nullptr;
+	sprPalette = nullptr;
+	sprites = nullptr;
+	bgRendered.fill(0);
+	tileVersions.fill(0);
+	tileVersion = 0;
+	invalidateLines();
+}
+
+void PpuRenderer::startFrame(uint8_t bgColor) {
+	std::fill(screen.begin(), screen.end(), bgColor);
+	std::fill(pixrendered.begin(), pixrendered.end(), 65);
+}
+
+void PpuRenderer::tileChanged(size_t index) {
+	tileVersions[index] = ++tileVersion;
+}
+
+// Forgets the background lines drawn, when bgbuffer was changed:
+void PpuRenderer::invalidateLines() {
+	for(size_t i = 0; i < lineCache.size(); ++i) {
+		lineCache[i].isValid = false;
+	}
+}
+
+// Returns if this line is in bgbuffer already:
+bool PpuRenderer::isLineCached(const BgLine& line) {
+	const LineCache& cache = lineCache[line.scan];
+	if(!cache.isValid || cache.line.fineX != line.fineX || cache.line.fineY != line.fineY) {
+		return false;
+	}
+	if(cache.line.tiles != line.tiles || cache.line.attribs != line.attribs || cache.palette != *imgPalette) {
+		return false;
+	}
+
+	// No tile can have changed since it was drawn:
+	if(cache.tileVersion != tileVersion) {
+		for(size_t i = 0; i < line.tiles.size(); ++i) {
+			if(tileVersions[line.tiles[i]] > cache.tileVersion) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void PpuRenderer::drawBgLine(const BgLine& line) {
+	// Reuse the line from the last frame if nothing it used changed:
+	int lineStart = line.scan << 8;
+	if(!line.toScreen) {
+		bool isCached = isLineCached(line);
+		FrameTiming::count_bg_line(isCached);
+		if(isCached) {
+			for(int i = lineStart; i < lineStart + 256; ++i) {
+				pixrendered[i] |= bgRendered[i];
+			}
+			return;
+		}
+	}
+
+	array<uint8_t, 256 * 240>& buffer = line.toScreen ? screen : bgbuffer;
+	int destIndex = (line.scan << 8) - line.fineX;
+	int tscanoffset = line.fineY << 3;
+
+	for(int tile = 0; tile < 32; ++tile) {
+		const array<uint8_t, 64>& tpix = (*tiles)[line.tiles[tile]].pix;
+		int att = line.attribs[tile];
+
+		// Render tile scanline:
+		int sx = 0;
+		int x = (tile << 3) - line.fineX;
+		if(x > -8) {
+			if(x < 0) {
+				destIndex -= x;
+				sx = -x;
+			}
+			if(sx == 0) {
+				drawBgTileRow(&buffer[destIndex], &pixrendered[destIndex], &tpix[tscanoffset], att);
+				destIndex += 8;
+			} else {
+				// The first tile is partly scrolled off:
+				for(; sx < 8; ++sx) {
+					int col = tpix[tscanoffset + sx];
+					if(col != 0) {
+						buffer[destIndex] = (*imgPalette)[col + att];
+						pixrendered[destIndex] |= 0x80;
+					}
+					++destIndex;
+				}
+			}
+		}
+	}
+
+	// Remember the line, and the pixels it rendered:
+	if(!line.toScreen) {
+		LineCache& cache = lineCache[line.scan];
+		cache.line = line;
+		cache.palette = *imgPalette;
+		cache.tileVersion = tileVersion;
+		cache.isValid = true;
+		for(int i = lineStart; i < lineStart + 256; ++i) {
+			bgRendered[i] = pixrendered[i] & 0x80;
+		}
+	}
+}
+
+// Draws the 8 pixels of one tile row, and marks them as rendered.
+// Transparent pixels are left alone:
+void PpuRenderer::drawBgTileRow(uint8_t* dest, uint8_t* rendered, const uint8_t* pix, int att) {
+#ifdef __SSE2__
+	// Each pixel's color is picked by comparing it to the 3 visible
+	// palette indexes, so there is no lookup per pixel:
+	__m128i index = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(pix));
+	__m128i clear = _mm_cmpeq_epi8(index, _mm_setzero_si128());
+	__m128i color = _mm_and_si128(_mm_cmpeq_epi8(index, _mm_set1_epi8(1)), _mm_set1_epi8((*imgPalette)[att + 1]));
+	color = _mm_or_si128(color, _mm_and_si128(_mm_cmpeq_epi8(index, _mm_set1_epi8(2)), _mm_set1_epi8((*imgPalette)[att + 2])));
+	color = _mm_or_si128(color, _mm_and_si128(_mm_cmpeq_epi8(index, _mm_set1_epi8(3)), _mm_set1_epi8((*imgPalette)[att + 3])));
+
+	__m128i* out = reinterpret_cast<__m128i*>(dest);
+	__m128i old = _mm_loadl_epi64(out);
+	_mm_storel_epi64(out, _mm_or_si128(_mm_and_si128(clear, old), _mm_andnot_si128(clear, color)));
+
+	__m128i* flags = reinterpret_cast<__m128i*>(rendered);
+	_mm_storel_epi64(flags, _mm_or_si128(_mm_loadl_epi64(flags), _mm_andnot_si128(clear, _mm_set1_epi8(static_cast<char>(0x80)))));
+#else
+	for(int i = 0; i < 8; ++i) {
+		if(pix[i] != 0) {
+			dest[i] = (*imgPalette)[pix[i] + att];
+			rendered[i] |= 0x80;
+		}
+	}
+#endif
+}
+
+// Copies the background drawn on these lines to the screen:
+void PpuRenderer::mergeBg(int startScan, int scanCount) {
+	int si = startScan << 8;
+	int ei = (startScan + scanCount) << 8;
+	if(ei > 0xF000) {
+		ei = 0xF000;
+	}
+	for(int destIndex = si; destIndex < ei; ++destIndex) {
+		if((pixrendered[destIndex] & 0x80) != 0) {
+			screen[destIndex] = bgbuffer[destIndex];
+		}
+	}
+}
+
+void PpuRenderer::drawSprites(int startscan, int scancount, bool bgPri, int spriteSize, int patternTable) {
+	const Sprites& spr = *sprites;
+
+	// Only visit the sprites on these lines, with this priority:
+	uint64_t visible = 0;
+	int endscan = std::min(startscan + scancount, static_cast<int>(spr.spriteLines.size()) - 1);
+	for(int line = std::max(startscan, 0); line <= endscan; ++line) {
+		visible |= spr.spriteLines[line];
+	}
+	visible &= bgPri ? spr.spritesBehindBg : ~spr.spritesBehindBg;
+
+	while(visible != 0) {
+		size_t i = __builtin_ctzll(visible);
+		visible &= visible - 1;
+		if(spr.sprX[i] >= 0 && spr.sprX[i] < 256) {
+			// Show sprite.
+			int srcy1 = 0;
+			int srcy2 = 8;
+			if(spriteSize == 0) {
+				// 8x8 sprites
+
+				if(spr.sprY[i] < startscan) {
+					srcy1 = startscan - spr.sprY[i] - 1;
+				}
+
+				if(spr.sprY[i] + 8 > startscan + scancount) {
+					srcy2 = startscan + scancount - spr.sprY[i] + 1;
+				}
+
+				int index = patternTable == 0 ? spr.sprTile[i] : spr.sprTile[i] + 256;
+				(*tiles)[index].render(0, srcy1, 8, srcy2, spr.sprX[i], spr.sprY[i] + 1, &screen, spr.sprCol[i], sprPalette, spr.horiFlip[i], spr.vertFlip[i], i, &pixrendered);
+			} else {
+				// 8x16 sprites
+				int top = spr.sprTile[i];
+				if((top & 1) != 0) {
+					top = spr.sprTile[i] - 1 + 256;
+				}
+
+				if(spr.sprY[i] < startscan) {
+					srcy1 = startscan - spr.sprY[i] - 1;
+				}
+
+				if(spr.sprY[i] + 8 > startscan + scancount) {
+					srcy2 = startscan + scancount - spr.sprY[i];
+				}
+
+				(*tiles)[top + (spr.vertFlip[i] ? 1 : 0)].render(0, srcy1, 8, srcy2, spr.sprX[i], spr.sprY[i] + 1, &screen, spr.sprCol[i], sprPalette, spr.horiFlip[i], spr.vertFlip[i], i, &pixrendered);
+
+				srcy1 = 0;
+				srcy2 = 8;
+
+				if(spr.sprY[i] + 8 < startscan) {
+					srcy1 = startscan - (spr.sprY[i] + 8 + 1);
+				}
+
+				if(spr.sprY[i] + 16 > startscan + scancount) {
+					srcy2 = startscan + scancount - (spr.sprY[i] + 8);
+				}
+
+				(*tiles)[top + (spr.vertFlip[i] ? 0 : 1)].render(0, srcy1, 8, srcy2, spr.sprX[i], spr.sprY[i] + 1 + 8, &screen, spr.sprCol[i], sprPalette, spr.horiFlip[i], spr.vertFlip[i], i, &pixrendered);
+
+			}
+		}
+	}
+}
+
+// Draws a line across and down the screen through this point:
+void PpuRenderer::drawCrosshair(int x, int y, uint8_t color) {
+	if(x >= 0 && x < 256 && y >= 0 && y < 240) {
+		for(size_t i = 0; i < 256; ++i) {
+			screen[(y << 8) + i] = color;
+		}
+		for(size_t i = 0; i < 240; ++i) {
+			screen[(i << 8) + x] = color;
+		}
+	}
+}
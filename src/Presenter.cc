@@ -0,0 +1,207 @@
+/*
+Copyright (c) 2012-2017 Matthew Brennan Jones <matthew.brennan.jones@gmail.com>
+A NES emulator in WebAssembly. Based on vNES.
+Licensed under GPLV3 or later
+Hosted at: https://github.com/workhorsy/SaltyNES
+*/
+
+/*
+This class puts finished frames on the screen. SDL only allows drawing on the
+main thread on some platforms, so by default frames are drawn on the main
+thread, which is the emulation thread. With --present-threaded a presenter
+thread owns the SDL renderer instead, so a slow upload or vsync never holds up
+emulation. Frames are handed over through three buffers: the maker fills the
+back one and swaps it with the ready one, and the drawer swaps the ready one
+with the one it shows. Neither side waits for the other to draw, and frames
+the drawer is too slow for are dropped. The pipeline's worker hands frames
+over the same way, for the main thread to draw at the end of the next frame.
+*/
+
+#include "SaltyNES.h"
+
+bool Presenter::_is_threaded = false;
+bool Presenter::_is_headless = false;
+array<Presenter::Frame, 3> Presenter::_frames;
+int Presenter::_back = 0;
+int Presenter::_front = 2;
+atomic<int> Presenter::_ready(1);
+atomic<int> Presenter::_renderer_state(0);
+atomic<bool> Presenter::_stop(false);
+std::thread Presenter::_thread;
+std::mutex Presenter::_wake_mutex;
+std::condition_variable Presenter::_wake;
+uint64_t Presenter::_last_hash = 0;
+
+bool Presenter::init(bool is_threaded) {
+#ifdef DESKTOP
+	if(is_threaded) {
+		// Start the presenter, and wait until it has made the renderer:
+		_is_threaded = true;
+		_stop = false;
+		_renderer_state = 0;
+		_thread = std::thread(Presenter::present_loop);
+		while(_renderer_state == 0) {
+			SDL_Delay(1);
+		}
+		if(_renderer_state < 0) {
+			_thread.join();
+			_is_threaded = false;
+			return false;
+		}
+		return true;
+	}
+#endif
+
+	_is_threaded = false;
+	return create_renderer();
+}
+
+// Frames are still made, but never drawn, and there is no renderer:
+void Presenter::init_headless() {
+	_is_threaded = false;
+	_is_headless = true;
+}
+
+void Presenter::close() {
+	if(_is_threaded) {
+		{
+			std::lock_guard<std::mutex> lock(_wake_mutex);
+			_stop = true;
+			_wake.notify_one();
+		}
+		if(_thread.joinable()) {
+			_thread.join();
+		}
+		_is_threaded = false;
+	}
+}
+
+bool Presenter::create_renderer() {
+	// Create a SDL renderer
+	Globals::g_renderer = SDL_CreateRenderer(
+		Globals::g_window,
+		-1,
+		SDL_RENDERER_ACCELERATED
+	);
+	if(!Globals::g_renderer) {
+		fprintf(stderr, "Couldn't create a renderer: %s\n", SDL_GetError());
+		return false;
+	}
+
+	// Create the SDL screen
+	Globals::g_screen = SDL_CreateTexture(Globals::g_renderer,
+			SDL_PIXELFORMAT_BGR888, SDL_TEXTUREACCESS_STREAMING, 256, 240);
+	if(!Globals::g_screen) {
+		fprintf(stderr, "Couldn't create a texture: %s\n", SDL_GetError());
+		return false;
+	}
+	return true;
+}
+
+Presenter::Frame& Presenter::back_frame() {
+	return _frames[_back];
+}
+
+// Hands the back frame to the presenter, or draws it when not threaded:
+void Presenter::publish() {
+	if(_is_headless) {
+		// Nothing to draw on
+	} else if(_is_threaded) {
+		hand_off();
+	} else {
+		draw(_frames[_back]);
+	}
+}
+
+// Makes the back frame the ready one, for the presenter or draw_ready:
+void Presenter::hand_off() {
+	std::lock_guard<std::mutex> lock(_wake_mutex);
+	_back = _ready.exchange(_back | NEW_FRAME) & ~NEW_FRAME;
+	_wake.notify_one();
+}
+
+// Draws the last frame handed off, if it wasn't drawn yet. This is how the
+// main thread draws the pipeline's frames when there is no presenter:
+void Presenter::draw_ready() {
+	if(_is_headless || _is_threaded || (_ready.load() & NEW_FRAME) == 0) {
+		return;
+	}
+
+	_front = _ready.exchange(_front) & ~NEW_FRAME;
+	draw(_frames[_front]);
+}
+
+void Presenter::present_loop() {
+	ChromeTrace::name_thread("presenter");
+	if(!create_renderer()) {
+		_renderer_state = -1;
+		return;
+	}
+	_renderer_state = 1;
+
+	while(true) {
+		// Wait for a new frame:
+		{
+			std::unique_lock<std::mutex> lock(_wake_mutex);
+			_wake.wait(lock, [] { return _stop || (_ready.load() & NEW_FRAME) != 0; });
+			if(_stop) {
+				break;
+			}
+		}
+
+		_front = _ready.exchange(_front) & ~NEW_FRAME;
+		draw(_frames[_front]);
+	}
+
+	// The renderer has to be destroyed by the thread that made it:
+	SDL_DestroyTexture(Globals::g_screen);
+	SDL_DestroyRenderer(Globals::g_renderer);
+	Globals::g_screen = nullptr;
+	Globals::g_renderer = nullptr;
+}
+
+void Presenter::draw(const Frame& frame) {
+	ChromeTrace::begin("present");
+	const int under_scan = static_cast<int>(PPU::UNDER_SCAN);
+	const SDL_Rect rect = { under_scan, under_scan, 256 - (under_scan * 2), 240 - (under_scan * 2) };
+
+	// Skip the upload if the frame is the same as the last one:
+	bool is_changed = true;
+	if(Globals::skipSameFrames) {
+		uint64_t hash = hash_frame(frame);
+		is_changed = (hash != _last_hash);
+		_last_hash = hash;
+	}
+
+	// Convert the color indexes to RGB, right into the texture:
+	void* pixels = nullptr;
+	int pitch = 0;
+	if(is_changed && SDL_LockTexture(Globals::g_screen, &rect, &pixels, &pitch) == 0) {
+		for(int y = 0; y < rect.h; ++y) {
+			const uint8_t* src = &frame.indexes[y << 8];
+			uint32_t* dest = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(pixels) + y * pitch);
+			for(int x = 0; x < rect.w; ++x) {
+				dest[x] = frame.colors[src[x]];
+			}
+		}
+		SDL_UnlockTexture(Globals::g_screen);
+	}
+
+	SDL_RenderClear(Globals::g_renderer);
+	SDL_RenderCopy(Globals::g_renderer, Globals::g_screen, nullptr, nullptr);
+	SDL_RenderPresent(Globals::g_renderer);
+	ChromeTrace::end("present");
+}
+
+// Returns a hash of the color indexes and the colors they are shown as:
+uint64_t Presenter::hash_frame(const Frame& frame) {
+	uint64_t hash = 14695981039346656037ULL;
+	const uint64_t* words = reinterpret_cast<const uint64_t*>(&frame.indexes[0]);
+	for(size_t i = 0; i < frame.indexes.size() / sizeof(uint64_t); ++i) {
+		hash = (hash ^ words[i]) * 1099511628211ULL;
+	}
+	for(size_t i = 0; i < frame.colors.size(); ++i) {
+		hash = (hash ^ frame.colors[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
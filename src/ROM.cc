@@ -8,7 +8,6 @@ Hosted at: https://github.com/workhorsy/SaltyNES
 
 
 #include "SaltyNES.h"
-#include "sha256sum.h"
 
 const int ROM::VERTICAL_MIRRORING;
 const int ROM::HORIZONTAL_MIRRORING;
@@ -307,13 +306,17 @@ ROM::~ROM() {
 	nes = nullptr;
 }
 
-string ROM::sha256sum(uint8_t* data, size_t length) {
-	// Get the sha256 hash of the data
-	unsigned char hash[32] = {0};
+string ROM::sha256sum(const uint8_t* data, size_t length) {
 	SHA256Context ctx;
 	SHA256Init(&ctx);
 	SHA256Update(&ctx, data, length);
-	SHA256Final(&ctx, hash);
+	return sha256sum(&ctx);
+}
+
+// Finishes a hash that was given the data a piece at a time:
+string ROM::sha256sum(SHA256Context* ctx) {
+	unsigned char hash[32] = {0};
+	SHA256Final(ctx, hash);
 
 	// Convert the hash into a string of hexadecimal values
 	char hex_map[] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
@@ -335,31 +338,47 @@ string ROM::getmapperName() {
 	return ss.str();
 }
 
-void ROM::load_from_data(string file_name, vector<uint8_t>* data, array<uint16_t, 0x2000>* save_ram) {
-	fileName = file_name;
-	auto sdata = vector<uint16_t>(data->size());
-	for(size_t i=0; i<sdata.size(); ++i) {
-		sdata[i] = static_cast<uint16_t>(data->data()[i] & 255);
+// Gets the rom's bytes from the file's bytes, and hashes them. A rom in a
+// .zip or .gz file is decoded into decoded, and hashed while it is decoded
+// instead of after:
+bool ROM::readImage(const uint8_t** data, size_t* size, vector<uint8_t>* decoded) {
+	if(RomArchive::is_archive(*data, *size)) {
+		SHA256Context ctx;
+		SHA256Init(&ctx);
+		bool isDecoded = RomArchive::decode(*data, *size, decoded, [&ctx](const uint8_t* chunk, size_t length) {
+			SHA256Update(&ctx, chunk, length);
+		});
+		if(!isDecoded) {
+			return false;
+		}
+		*data = decoded->data();
+		*size = decoded->size();
+		_sha256 = sha256sum(&ctx);
+	} else {
+		_sha256 = sha256sum(*data, *size);
 	}
-	log_to_browser("log: rom::load_from_data");
+	return true;
+}
 
-	// Get sha256 of the rom
-	_sha256 = sha256sum(data->data(), data->size());
-	log_to_browser("log: rom::sha256sum");
+// Reads the iNES header. Returns false if it is not one:
+bool ROM::readHeader(const uint8_t* data, size_t size) {
+	// Check the file is big enough for the header:
+	if(size < header.size()) {
+		return false;
+	}
 
 	// Read header:
 	for(int i = 0; i < header.size(); ++i) {
-		header[i] = sdata[i];
+		header[i] = data[i];
 	}
 
 	// Check first four bytes:
-	if(sdata[0] != 'N' ||
-	sdata[1] != 'E' ||
-	sdata[2] != 'S' ||
-	sdata[3] != 0x1A) {
+	if(data[0] != 'N' ||
+	data[1] != 'E' ||
+	data[2] != 'S' ||
+	data[3] != 0x1A) {
 		//System.out.println("Header is incorrect.");
-		valid = false;
-		return;
+		return false;
 	}
 
 	// Read header:
@@ -371,6 +390,40 @@ void ROM::load_from_data(string file_name, vector<uint8_t>* data, array<uint16_t
 	fourScreen = (header[6] & 8) != 0;
 	mapperType = (header[6] >> 4) | (header[7] & 0xF0);
 
+	// Check whether byte 8-15 are zero's:
+	bool foundError = false;
+	for(int i = 8; i < 16; ++i) {
+		if(header[i] != 0) {
+			foundError = true;
+			break;
+		}
+	}
+	if(foundError) {
+		// Ignore byte 7.
+		mapperType &= 0xF;
+	}
+	return true;
+}
+
+// Loads the ROM from the file's bytes. They are only read here, so they can
+// be a read only mapping of the file:
+void ROM::load_from_data(string file_name, const uint8_t* data, size_t size, array<uint16_t, 0x2000>* save_ram) {
+	uint64_t start = SDL_GetPerformanceCounter();
+	fileName = file_name;
+	log_to_browser("log: rom::load_from_data");
+
+	vector<uint8_t> decoded;
+	if(!readImage(&data, &size, &decoded)) {
+		valid = false;
+		return;
+	}
+	log_to_browser("log: rom::sha256sum");
+
+	if(!readHeader(data, size)) {
+		valid = false;
+		return;
+	}
+
 	printf("prog_rom_pages: %lu\n", static_cast<long>(romCount));
 	printf("char_rom_pages: %lu\n", static_cast<long>(vromCount));
 	printf("mirroring: %d\n", mirroring);
@@ -385,19 +438,6 @@ void ROM::load_from_data(string file_name, vector<uint8_t>* data, array<uint16_t
 		loadBatteryRam();
 	}
 
-	// Check whether byte 8-15 are zero's:
-	bool foundError = false;
-	for(int i = 8; i < 16; ++i) {
-		if(header[i] != 0) {
-			foundError = true;
-			break;
-		}
-	}
-	if(foundError) {
-		// Ignore byte 7.
-		mapperType &= 0xF;
-	}
-
 	rom = vector<array<uint16_t, 16384>>(romCount);
 	for(size_t i=0; i<romCount; ++i) {
 		rom[i].fill(0);
@@ -408,12 +448,10 @@ void ROM::load_from_data(string file_name, vector<uint8_t>* data, array<uint16_t
 		vrom[i].fill(0);
 	}
 
+	// CHR-ROM banks are converted to tiles when first mapped. The space for
+	// them is made now, so mapping a bank during a frame never allocates:
 	vromTile = vector<array<Tile, 256>>(vromCount);
-	for(size_t i=0; i<vromTile.size(); ++i) {
-		for(size_t j=0; j<vromTile[i].size(); ++j) {
-			vromTile[i][j] = Tile();
-		}
-	}
+	vromTileDecoded = vector<bool>(vromCount, false);
 
 	//try{
 
@@ -421,10 +459,10 @@ void ROM::load_from_data(string file_name, vector<uint8_t>* data, array<uint16_t
 	size_t offset = 16;
 	for(size_t i = 0; i < romCount; ++i) {
 		for(size_t j = 0; j < 16384; ++j) {
-			if(offset + j >= data->size()) {
+			if(offset + j >= size) {
 				break;
 			}
-			rom[i][j] = sdata[offset + j];
+			rom[i][j] = data[offset + j];
 		}
 		offset += 16384;
 	}
@@ -432,38 +470,14 @@ void ROM::load_from_data(string file_name, vector<uint8_t>* data, array<uint16_t
 	// Load CHR-ROM banks:
 	for(size_t i = 0; i < vromCount; ++i) {
 		for(size_t j = 0; j < 4096; ++j) {
-			if(offset + j >= data->size()) {
+			if(offset + j >= size) {
 				break;
 			}
-			vrom[i][j] = sdata[offset + j];
+			vrom[i][j] = data[offset + j];
 		}
 		offset += 4096;
 	}
 
-	// Create VROM tiles:
-	for(size_t i = 0; i < vromCount; ++i) {
-		for(size_t j = 0; j < 256; ++j) {
-			vromTile[i][j] = Tile();
-		}
-	}
-
-	// Convert CHR-ROM banks to tiles:
-	//System.out.println("Converting CHR-ROM image data..");
-	//System.out.println("VROM bank count: "+vromCount);
-	int tileIndex = 0;
-	int leftOver = 0;
-	for(size_t v = 0; v < vromCount; ++v) {
-		for(size_t i = 0; i < 4096; ++i) {
-			tileIndex = i >> 4;
-			leftOver = i % 16;
-			if(leftOver < 8) {
-				vromTile[v][tileIndex].setScanline(leftOver, vrom[v][i], vrom[v][i + 8]);
-			} else {
-				vromTile[v][tileIndex].setScanline(leftOver - 8, vrom[v][i - 8], vrom[v][i]);
-			}
-		}
-	}
-
 	/*
 	tileIndex = (address+i)>>4;
 	leftOver = (address+i) % 16;
@@ -481,6 +495,9 @@ void ROM::load_from_data(string file_name, vector<uint8_t>* data, array<uint16_t
 	}*/
 
 	valid = true;
+
+	double ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+	printf("load_time: %.2f ms\n", ms);
 }
 
 bool ROM::isValid() {
@@ -509,7 +526,24 @@ array<uint16_t, 4096>* ROM::getVromBank(int bank) {
 }
 
 array<Tile, 256>* ROM::getVromBankTiles(int bank) {
-	return &(vromTile[bank]);
+	if(!vromTileDecoded[bank]) {
+		decodeVromBank(bank);
+	}
+	return &vromTile[bank];
+}
+
+// Converts a CHR-ROM bank to tiles:
+void ROM::decodeVromBank(int bank) {
+	ChromeTrace::begin("decodeVromBank", "bank", bank);
+	array<Tile, 256>& tiles = vromTile[bank];
+	array<uint16_t, 4096>& data = vrom[bank];
+	for(size_t i = 0; i < tiles.size(); ++i) {
+		for(size_t row = 0; row < 8; ++row) {
+			tiles[i].setScanline(row, data[(i << 4) + row], data[(i << 4) + row + 8]);
+		}
+	}
+	vromTileDecoded[bank] = true;
+	ChromeTrace::end("decodeVromBank");
 }
 
 int ROM::getMirroringType() {
@@ -555,7 +589,7 @@ string ROM::getFileName() {
 }
 
 bool ROM::mapperSupported() {
-	return ROM::_mapperStatus[mapperType].is_supported;
+	return mapperType < ROM::_mapperStatus.size() && ROM::_mapperStatus[mapperType].is_supported;
 }
 
 shared_ptr<MapperDefault> ROM::createMapper() {
@@ -0,0 +1,561 @@
+/*
+Copyright (c) 2012-2017 Matthew Brennan Jones <matthew.brennan.jones@gmail.com>
+A NES emulator in WebAssembly. Based on vNES.
+Licensed under GPLV3 or later
+Hosted at: https://github.com/workhorsy/SaltyNES
+*/
+
+/*
+This class decodes roms stored in .gz and .zip files. The deflate data is
+decoded straight into the rom image, and every piece decoded is handed to a
+callback while it is still in the cache, so the rom can be hashed without
+another pass over it. No temporary files are made.
+*/
+
+#include "SaltyNES.h"
+
+// Decoded bytes are handed to the callback in pieces this big:
+static const size_t REPORT_SIZE = 32768;
+
+// Codes this long or shorter are decoded with one table lookup:
+static const int FAST_BITS = 10;
+
+static const uint16_t LENGTH_BASE[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t LENGTH_EXTRA[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t DIST_BASE[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t DIST_EXTRA[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static const uint8_t CODE_LENGTH_ORDER[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+static uint16_t read_le16(const uint8_t* data) {
+	return static_cast<uint16_t>(data[0] | (data[1] << 8));
+}
+
+static uint32_t read_le32(const uint8_t* data) {
+	return static_cast<uint32_t>(data[0]) |
+		(static_cast<uint32_t>(data[1]) << 8) |
+		(static_cast<uint32_t>(data[2]) << 16) |
+		(static_cast<uint32_t>(data[3]) << 24);
+}
+
+static bool fail(const char* reason) {
+	fprintf(stderr, "Error while decoding rom: %s\n", reason);
+	return false;
+}
+
+static array<uint32_t, 256> make_crc32_table() {
+	array<uint32_t, 256> table;
+	for(uint32_t i = 0; i < 256; ++i) {
+		uint32_t crc = i;
+		for(int j = 0; j < 8; ++j) {
+			crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+		}
+		table[i] = crc;
+	}
+	return table;
+}
+
+// Made once, even when roms are decoded on many threads:
+static const array<uint32_t, 256>& crc32_table() {
+	static const array<uint32_t, 256> table = make_crc32_table();
+	return table;
+}
+
+// Canonical Huffman codes. Short codes are looked up in fast, which holds the
+// symbol and code length. Longer ones are walked a bit at a time:
+struct Huffman {
+	array<uint16_t, 16> count;
+	array<uint16_t, 288> symbol;
+	array<uint16_t, 1 << FAST_BITS> fast;
+
+	bool build(const uint8_t* lengths, int n) {
+		count.fill(0);
+		for(int i = 0; i < n; ++i) {
+			++count[lengths[i]];
+		}
+		count[0] = 0;
+
+		// Fail if there are more codes than the lengths allow
+		int left = 1;
+		for(int len = 1; len < 16; ++len) {
+			left = (left << 1) - count[len];
+			if(left < 0) {
+				return false;
+			}
+		}
+
+		array<uint16_t, 16> offsets;
+		offsets[1] = 0;
+		for(int len = 1; len < 15; ++len) {
+			offsets[len + 1] = offsets[len] + count[len];
+		}
+		for(int i = 0; i < n; ++i) {
+			if(lengths[i] != 0) {
+				symbol[offsets[lengths[i]]++] = static_cast<uint16_t>(i);
+			}
+		}
+
+		// Codes are stored bit reversed, so fill every entry that starts with them
+		fast.fill(0);
+		int code = 0;
+		int index = 0;
+		for(int len = 1; len <= FAST_BITS; ++len) {
+			for(int i = 0; i < count[len]; ++i) {
+				int reversed = 0;
+				for(int bit = 0; bit < len; ++bit) {
+					reversed |= ((code >> bit) & 1) << (len - 1 - bit);
+				}
+				for(int entry = reversed; entry < (1 << FAST_BITS); entry += 1 << len) {
+					fast[entry] = static_cast<uint16_t>((symbol[index] << 4) | len);
+				}
+				++code;
+				++index;
+			}
+			code <<= 1;
+		}
+		return true;
+	}
+};
+
+// Decodes a deflate stream into the end of out:
+struct Inflater {
+	const uint8_t* in;
+	size_t size;
+	size_t pos;
+	uint64_t bits;
+	int bitCount;
+	vector<uint8_t>* out;
+	size_t reported;
+	uint32_t crc;
+	const function<void(const uint8_t*, size_t)>* onData;
+	Huffman lengthCodes;
+	Huffman distCodes;
+
+	// Fills the bit buffer. Past the end of the input zeros are read, which
+	// is only an error if they are used:
+	inline void refill() {
+		while(bitCount <= 56) {
+			uint64_t byte = pos < size ? in[pos] : 0;
+			++pos;
+			bits |= byte << bitCount;
+			bitCount += 8;
+		}
+	}
+
+	inline bool isOverrun() {
+		return pos - (bitCount >> 3) > size;
+	}
+
+	inline int getBits(int n) {
+		if(bitCount < n) {
+			refill();
+		}
+		int value = static_cast<int>(bits & ((1ull << n) - 1));
+		bits >>= n;
+		bitCount -= n;
+		return value;
+	}
+
+	inline int decode(const Huffman& h) {
+		if(bitCount < 15) {
+			refill();
+		}
+		int entry = h.fast[bits & ((1 << FAST_BITS) - 1)];
+		if(entry != 0) {
+			int len = entry & 15;
+			bits >>= len;
+			bitCount -= len;
+			return entry >> 4;
+		}
+
+		int code = 0;
+		int first = 0;
+		int index = 0;
+		for(int len = 1; len < 16; ++len) {
+			code |= static_cast<int>(bits & 1);
+			bits >>= 1;
+			--bitCount;
+			int count = h.count[len];
+			if(code - count < first) {
+				return h.symbol[index + (code - first)];
+			}
+			index += count;
+			first = (first + count) << 1;
+			code <<= 1;
+		}
+		return -1;
+	}
+
+	// Hands the bytes decoded since last time to the callback:
+	void report() {
+		const array<uint32_t, 256>& table = crc32_table();
+		const uint8_t* data = out->data() + reported;
+		size_t length = out->size() - reported;
+		for(size_t i = 0; i < length; ++i) {
+			crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+		}
+		(*onData)(data, length);
+		reported = out->size();
+	}
+
+	bool storedBlock() {
+		// Go back to the first whole byte not used yet
+		bits >>= bitCount & 7;
+		bitCount -= bitCount & 7;
+		pos -= bitCount >> 3;
+		bits = 0;
+		bitCount = 0;
+
+		if(pos + 4 > size) {
+			return fail("stored block is cut off");
+		}
+		size_t len = read_le16(&in[pos]);
+		size_t nlen = read_le16(&in[pos + 2]);
+		pos += 4;
+		if(len != (~nlen & 0xFFFF)) {
+			return fail("stored block has a bad length");
+		}
+		if(pos + len > size) {
+			return fail("stored block is cut off");
+		}
+		if(out->size() + len > RomArchive::MAX_SIZE) {
+			return fail("rom is too big");
+		}
+		out->insert(out->end(), in + pos, in + pos + len);
+		pos += len;
+		return true;
+	}
+
+	bool codesBlock() {
+		vector<uint8_t>& o = *out;
+		while(true) {
+			if(isOverrun()) {
+				return fail("deflate data is cut off");
+			}
+			int sym = decode(lengthCodes);
+			if(sym < 256) {
+				if(sym < 0) {
+					return fail("bad literal or length code");
+				}
+				o.push_back(static_cast<uint8_t>(sym));
+			} else if(sym == 256) {
+				return true;
+			} else {
+				sym -= 257;
+				if(sym >= 29) {
+					return fail("bad length code");
+				}
+				size_t len = LENGTH_BASE[sym] + getBits(LENGTH_EXTRA[sym]);
+				int distSym = decode(distCodes);
+				if(distSym < 0 || distSym >= 30) {
+					return fail("bad distance code");
+				}
+				size_t dist = DIST_BASE[distSym] + getBits(DIST_EXTRA[distSym]);
+				if(dist > o.size()) {
+					return fail("distance is before the start of the rom");
+				}
+				if(o.size() + len > RomArchive::MAX_SIZE) {
+					return fail("rom is too big");
+				}
+				size_t from = o.size() - dist;
+				for(size_t i = 0; i < len; ++i) {
+					o.push_back(o[from + i]);
+				}
+			}
+
+			if(o.size() - reported >= REPORT_SIZE) {
+				report();
+			}
+		}
+	}
+
+	bool fixedCodes() {
+		array<uint8_t, 288> lengths;
+		std::fill(lengths.begin(), lengths.begin() + 144, 8);
+		std::fill(lengths.begin() + 144, lengths.begin() + 256, 9);
+		std::fill(lengths.begin() + 256, lengths.begin() + 280, 7);
+		std::fill(lengths.begin() + 280, lengths.end(), 8);
+		lengthCodes.build(lengths.data(), 288);
+
+		std::fill(lengths.begin(), lengths.begin() + 30, 5);
+		distCodes.build(lengths.data(), 30);
+		return true;
+	}
+
+	bool dynamicCodes() {
+		int lengthCount = getBits(5) + 257;
+		int distCount = getBits(5) + 1;
+		int codeCount = getBits(4) + 4;
+		if(lengthCount > 286 || distCount > 30) {
+			return fail("too many codes");
+		}
+
+		array<uint8_t, 320> lengths;
+		lengths.fill(0);
+		for(int i = 0; i < codeCount; ++i) {
+			lengths[CODE_LENGTH_ORDER[i]] = static_cast<uint8_t>(getBits(3));
+		}
+		if(!lengthCodes.build(lengths.data(), 19)) {
+			return fail("bad code length codes");
+		}
+
+		// Read the lengths of both codes, which can run from one into the other
+		int total = lengthCount + distCount;
+		int index = 0;
+		lengths.fill(0);
+		while(index < total) {
+			if(isOverrun()) {
+				return fail("deflate data is cut off");
+			}
+			int sym = decode(lengthCodes);
+			if(sym < 0) {
+				return fail("bad code length");
+			}
+			if(sym < 16) {
+				lengths[index++] = static_cast<uint8_t>(sym);
+				continue;
+			}
+
+			uint8_t len = 0;
+			int repeat = 0;
+			if(sym == 16) {
+				if(index == 0) {
+					return fail("repeat with no code length before it");
+				}
+				len = lengths[index - 1];
+				repeat = 3 + getBits(2);
+			} else if(sym == 17) {
+				repeat = 3 + getBits(3);
+			} else {
+				repeat = 11 + getBits(7);
+			}
+			if(index + repeat > total) {
+				return fail("too many code lengths");
+			}
+			std::fill(lengths.begin() + index, lengths.begin() + index + repeat, len);
+			index += repeat;
+		}
+
+		if(lengths[256] == 0) {
+			return fail("no end of block code");
+		}
+		if(!lengthCodes.build(lengths.data(), lengthCount)) {
+			return fail("bad literal and length codes");
+		}
+		if(!distCodes.build(lengths.data() + lengthCount, distCount)) {
+			return fail("bad distance codes");
+		}
+		return true;
+	}
+
+	bool inflate() {
+		bool isLast = false;
+		while(!isLast) {
+			isLast = getBits(1) == 1;
+			int type = getBits(2);
+			bool isOk = false;
+			if(type == 0) {
+				isOk = storedBlock();
+			} else if(type == 1) {
+				isOk = fixedCodes() && codesBlock();
+			} else if(type == 2) {
+				isOk = dynamicCodes() && codesBlock();
+			} else {
+				isOk = fail("bad block type");
+			}
+			if(!isOk) {
+				return false;
+			}
+			if(isOverrun()) {
+				return fail("deflate data is cut off");
+			}
+		}
+		report();
+		return true;
+	}
+};
+
+// Decodes one stored or deflated file, and checks its CRC and size:
+static bool decode_file(const uint8_t* data, size_t size, int method, uint32_t crc, uint32_t length, vector<uint8_t>* out, const function<void(const uint8_t*, size_t)>& on_data) {
+	if(length > RomArchive::MAX_SIZE) {
+		return fail("rom is too big");
+	}
+	out->clear();
+	out->reserve(length);
+
+	auto inflater = make_shared<Inflater>();
+	inflater->in = data;
+	inflater->size = size;
+	inflater->pos = 0;
+	inflater->bits = 0;
+	inflater->bitCount = 0;
+	inflater->out = out;
+	inflater->reported = 0;
+	inflater->crc = 0xFFFFFFFF;
+	inflater->onData = &on_data;
+
+	if(method == 0) {
+		out->insert(out->end(), data, data + size);
+		inflater->report();
+	} else if(method == 8) {
+		if(!inflater->inflate()) {
+			return false;
+		}
+	} else {
+		return fail("unsupported compression method");
+	}
+
+	if((inflater->crc ^ 0xFFFFFFFF) != crc) {
+		return fail("CRC does not match");
+	}
+	if(static_cast<uint32_t>(out->size()) != length) {
+		return fail("size does not match");
+	}
+	return true;
+}
+
+static bool is_gzip(const uint8_t* data, size_t size) {
+	return size >= 2 && data[0] == 0x1F && data[1] == 0x8B;
+}
+
+static bool is_zip(const uint8_t* data, size_t size) {
+	return size >= 4 && read_le32(data) == 0x04034B50;
+}
+
+static bool decode_gzip(const uint8_t* data, size_t size, vector<uint8_t>* out, const function<void(const uint8_t*, size_t)>& on_data) {
+	if(size < 18 || data[2] != 8) {
+		return fail("not a deflated gzip file");
+	}
+
+	// Skip the optional header fields
+	const uint8_t FEXTRA = 4;
+	const uint8_t FNAME = 8;
+	const uint8_t FCOMMENT = 16;
+	const uint8_t FHCRC = 2;
+	uint8_t flags = data[3];
+	size_t end = size - 8;
+	size_t pos = 10;
+	if((flags & FEXTRA) != 0) {
+		if(pos + 2 > end) {
+			return fail("gzip header is cut off");
+		}
+		pos += 2 + read_le16(&data[pos]);
+	}
+	if((flags & FNAME) != 0) {
+		while(pos < end && data[pos] != 0) {
+			++pos;
+		}
+		++pos;
+	}
+	if((flags & FCOMMENT) != 0) {
+		while(pos < end && data[pos] != 0) {
+			++pos;
+		}
+		++pos;
+	}
+	if((flags & FHCRC) != 0) {
+		pos += 2;
+	}
+	if(pos > end) {
+		return fail("gzip header is cut off");
+	}
+
+	uint32_t crc = read_le32(&data[end]);
+	uint32_t length = read_le32(&data[end + 4]);
+	return decode_file(&data[pos], end - pos, 8, crc, length, out, on_data);
+}
+
+static bool ends_with_nes(const uint8_t* name, size_t length) {
+	return length >= 4 && name[length - 4] == '.' &&
+		tolower(name[length - 3]) == 'n' &&
+		tolower(name[length - 2]) == 'e' &&
+		tolower(name[length - 1]) == 's';
+}
+
+static bool decode_zip(const uint8_t* data, size_t size, vector<uint8_t>* out, const function<void(const uint8_t*, size_t)>& on_data) {
+	// Find the end of central directory record, which can have a comment after it
+	const size_t EOCD_SIZE = 22;
+	if(size < EOCD_SIZE) {
+		return fail("zip file is cut off");
+	}
+	size_t eocd = size - EOCD_SIZE;
+	size_t lowest = size > EOCD_SIZE + 0xFFFF ? size - EOCD_SIZE - 0xFFFF : 0;
+	while(read_le32(&data[eocd]) != 0x06054B50) {
+		if(eocd == lowest) {
+			return fail("zip file has no central directory");
+		}
+		--eocd;
+	}
+	size_t entryCount = read_le16(&data[eocd + 10]);
+	size_t pos = read_le32(&data[eocd + 16]);
+
+	// Use the first .nes file, or the first file if none end in .nes
+	size_t chosen = 0;
+	bool isChosen = false;
+	for(size_t i = 0; i < entryCount; ++i) {
+		if(pos + 46 > size || read_le32(&data[pos]) != 0x02014B50) {
+			return fail("zip central directory is broken");
+		}
+		size_t nameLength = read_le16(&data[pos + 28]);
+		size_t next = pos + 46 + nameLength + read_le16(&data[pos + 30]) + read_le16(&data[pos + 32]);
+		if(next > size) {
+			return fail("zip central directory is broken");
+		}
+		const uint8_t* name = &data[pos + 46];
+		bool isDirectory = nameLength > 0 && name[nameLength - 1] == '/';
+		if(ends_with_nes(name, nameLength)) {
+			chosen = pos;
+			isChosen = true;
+			break;
+		} else if(!isChosen && !isDirectory) {
+			chosen = pos;
+			isChosen = true;
+		}
+		pos = next;
+	}
+	if(!isChosen) {
+		return fail("zip file has no files in it");
+	}
+
+	// The sizes and CRC are read from the central directory, because the
+	// local header does not have them if they were written after the data
+	int method = read_le16(&data[chosen + 10]);
+	uint32_t crc = read_le32(&data[chosen + 16]);
+	size_t compressedSize = read_le32(&data[chosen + 20]);
+	uint32_t length = read_le32(&data[chosen + 24]);
+	size_t local = read_le32(&data[chosen + 42]);
+	if(local + 30 > size || read_le32(&data[local]) != 0x04034B50) {
+		return fail("zip local header is broken");
+	}
+	size_t start = local + 30 + read_le16(&data[local + 26]) + read_le16(&data[local + 28]);
+	if(start + compressedSize > size) {
+		return fail("zip file is cut off");
+	}
+	return decode_file(&data[start], compressedSize, method, crc, length, out, on_data);
+}
+
+bool RomArchive::is_archive(const uint8_t* data, size_t size) {
+	return is_gzip(data, size) || is_zip(data, size);
+}
+
+bool RomArchive::decode(const uint8_t* data, size_t size, vector<uint8_t>* out, const function<void(const uint8_t*, size_t)>& on_data) {
+	if(is_gzip(data, size)) {
+		return decode_gzip(data, size, out, on_data);
+	} else if(is_zip(data, size)) {
+		return decode_zip(data, size, out, on_data);
+	}
+	return fail("not a .zip or .gz file");
+}
@@ -0,0 +1,291 @@
+/*
+Copyright (c) 2012-2017 Matthew Brennan Jones <matthew.brennan.jones@gmail.com>
+A NES emulator in WebAssembly. Based on vNES.
+Licensed under GPLV3 or later
+Hosted at: https://github.com/workhorsy/SaltyNES
+*/
+
+/*
+This class indexes a directory of roms. The headers are read by ROM, the same
+as when a game is loaded, and the roms are hashed on a pool of threads. What
+was found is written to a binary index file in the directory, keyed by the
+file's path, size and mtime, so the next run only reads the files that are
+new or changed.
+*/
+
+#include "SaltyNES.h"
+
+#ifdef DESKTOP
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char INDEX_MAGIC[8] = { 'S', 'N', 'I', 'N', 'D', 'E', 'X', '1' };
+
+const string RomIndex::FILE_NAME = "saltynes_index.bin";
+
+// Returns the file's mtime in nanoseconds:
+static int64_t get_mtime(const struct stat& info) {
+#ifdef __APPLE__
+	return static_cast<int64_t>(info.st_mtimespec.tv_sec) * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+	return static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+}
+
+static bool is_rom_file(const string& name) {
+	string lower = name;
+	std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+	for(const char* extension : { ".nes", ".zip", ".gz" }) {
+		size_t length = strlen(extension);
+		if(lower.size() > length && lower.compare(lower.size() - length, length, extension) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Adds the rom files under the directory, with their paths relative to root.
+// Links to directories are not followed, so a loop can't be walked forever:
+void RomIndex::find_roms(string root, string prefix, map<string, Entry>* found) {
+	string dir_name = prefix.empty() ? root : root + "/" + prefix;
+	DIR* dir = opendir(dir_name.c_str());
+	if(!dir) {
+		fprintf(stderr, "Couldn't read directory '%s': %s\n", dir_name.c_str(), strerror(errno));
+		return;
+	}
+
+	while(struct dirent* item = readdir(dir)) {
+		string name = item->d_name;
+		if(name == "." || name == "..") {
+			continue;
+		}
+		string path = prefix.empty() ? name : prefix + "/" + name;
+		string full_path = root + "/" + path;
+
+		struct stat info;
+		if(lstat(full_path.c_str(), &info) != 0) {
+			continue;
+		}
+		if(S_ISDIR(info.st_mode)) {
+			find_roms(root, path, found);
+			continue;
+		}
+		if(S_ISLNK(info.st_mode) && (stat(full_path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))) {
+			continue;
+		}
+		if(S_ISREG(info.st_mode) && is_rom_file(name)) {
+			Entry entry = Entry();
+			entry.size = static_cast<uint64_t>(info.st_size);
+			entry.mtime = get_mtime(info);
+			(*found)[path] = entry;
+		}
+	}
+	closedir(dir);
+}
+
+// Reads and hashes the rom, filling in everything but the size and mtime.
+// Returns false if the file couldn't be read:
+bool RomIndex::read_rom(string file_name, Entry* entry) {
+	int fd = open(file_name.c_str(), O_RDONLY);
+	if(fd == -1) {
+		fprintf(stderr, "Couldn't read rom '%s': %s\n", file_name.c_str(), strerror(errno));
+		return false;
+	}
+	struct stat info;
+	if(fstat(fd, &info) != 0) {
+		fprintf(stderr, "Couldn't read rom '%s': %s\n", file_name.c_str(), strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	// Empty files are indexed as not being roms
+	entry->sha256.fill(0);
+	entry->flags = 0;
+	size_t size = static_cast<size_t>(info.st_size);
+	if(size == 0) {
+		close(fd);
+		return true;
+	}
+
+	void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(mapping == MAP_FAILED) {
+		fprintf(stderr, "Couldn't read rom '%s': %s\n", file_name.c_str(), strerror(errno));
+		return false;
+	}
+
+	// Use the same code as loading the game
+	shared_ptr<ROM> rom = make_shared<ROM>()->Init(nullptr);
+	const uint8_t* data = static_cast<const uint8_t*>(mapping);
+	vector<uint8_t> decoded;
+	if(!rom->readImage(&data, &size, &decoded)) {
+		fprintf(stderr, "Couldn't decode rom '%s'\n", file_name.c_str());
+	} else {
+		for(size_t i = 0; i < entry->sha256.size(); ++i) {
+			entry->sha256[i] = static_cast<uint8_t>(stoi(rom->_sha256.substr(i * 2, 2), nullptr, 16));
+		}
+		if(rom->readHeader(data, size)) {
+			entry->mapper = static_cast<uint16_t>(rom->getMapperType());
+			entry->rom_count = static_cast<uint16_t>(rom->getRomBankCount());
+			entry->vrom_count = static_cast<uint16_t>(rom->getVromBankCount());
+			entry->mirroring = static_cast<uint8_t>(rom->mirroring);
+			entry->flags = IS_VALID |
+				(rom->hasBatteryRam() ? HAS_BATTERY_RAM : 0) |
+				(rom->hasTrainer() ? HAS_TRAINER : 0) |
+				(rom->fourScreen ? IS_FOUR_SCREEN : 0) |
+				(rom->mapperSupported() ? IS_MAPPER_SUPPORTED : 0);
+		}
+	}
+	munmap(mapping, static_cast<size_t>(info.st_size));
+	return true;
+}
+
+// Reads an index written by save(). A missing or broken index is empty:
+bool RomIndex::load(string file_name, map<string, Entry>* entries) {
+	FILE* file = fopen(file_name.c_str(), "rb");
+	if(!file) {
+		return false;
+	}
+
+	char magic[sizeof(INDEX_MAGIC)];
+	uint32_t count = 0;
+	if(fread(magic, sizeof(magic), 1, file) != 1 ||
+		memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0 ||
+		fread(&count, sizeof(count), 1, file) != 1) {
+		fprintf(stderr, "Not a rom index file, it will be rewritten: '%s'\n", file_name.c_str());
+		fclose(file);
+		return false;
+	}
+
+	Entry entry;
+	uint16_t length = 0;
+	for(uint32_t i = 0; i < count; ++i) {
+		if(fread(&entry, sizeof(entry), 1, file) != 1 || fread(&length, sizeof(length), 1, file) != 1) {
+			break;
+		}
+		string path(length, '\0');
+		if(length > 0 && fread(&path[0], length, 1, file) != 1) {
+			break;
+		}
+		(*entries)[path] = entry;
+	}
+	fclose(file);
+	return true;
+}
+
+// Writes the index to a temporary file, then moves it over the old one, so a
+// crash can't leave half an index:
+bool RomIndex::save(string file_name, const map<string, Entry>& entries) {
+	string temp_name = file_name + ".tmp";
+	FILE* file = fopen(temp_name.c_str(), "wb");
+	if(!file) {
+		fprintf(stderr, "Couldn't write rom index '%s': %s\n", temp_name.c_str(), strerror(errno));
+		return false;
+	}
+
+	uint32_t count = static_cast<uint32_t>(entries.size());
+	fwrite(INDEX_MAGIC, sizeof(INDEX_MAGIC), 1, file);
+	fwrite(&count, sizeof(count), 1, file);
+	for(const auto& pair : entries) {
+		uint16_t length = static_cast<uint16_t>(std::min<size_t>(pair.first.size(), 0xFFFF));
+		fwrite(&pair.second, sizeof(Entry), 1, file);
+		fwrite(&length, sizeof(length), 1, file);
+		fwrite(pair.first.data(), length, 1, file);
+	}
+	bool is_written = ferror(file) == 0;
+	is_written = fclose(file) == 0 && is_written;
+
+	if(!is_written || rename(temp_name.c_str(), file_name.c_str()) != 0) {
+		fprintf(stderr, "Couldn't write rom index '%s': %s\n", file_name.c_str(), strerror(errno));
+		remove(temp_name.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool RomIndex::index(string dir) {
+	uint64_t start = SDL_GetPerformanceCounter();
+	while(dir.size() > 1 && dir.back() == '/') {
+		dir.pop_back();
+	}
+	string index_name = dir + "/" + FILE_NAME;
+
+	map<string, Entry> old_entries;
+	load(index_name, &old_entries);
+
+	map<string, Entry> entries;
+	find_roms(dir, "", &entries);
+
+	// Keep what is known about files that didn't change
+	vector<map<string, Entry>::iterator> changed;
+	for(auto it = entries.begin(); it != entries.end(); ++it) {
+		auto old = old_entries.find(it->first);
+		if(old != old_entries.end() && old->second.size == it->second.size && old->second.mtime == it->second.mtime) {
+			it->second = old->second;
+		} else {
+			changed.push_back(it);
+		}
+	}
+
+	// Read the new and changed files on a pool of threads
+	atomic<size_t> next(0);
+	vector<uint8_t> is_read(changed.size(), 0);
+	auto read_roms = [&]() {
+		size_t i;
+		while((i = next++) < changed.size()) {
+			is_read[i] = read_rom(dir + "/" + changed[i]->first, &changed[i]->second);
+		}
+	};
+	size_t thread_count = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	thread_count = std::min(thread_count, std::max<size_t>(changed.size(), 1));
+	vector<std::thread> threads;
+	for(size_t i = 1; i < thread_count; ++i) {
+		threads.push_back(std::thread(read_roms));
+	}
+	read_roms();
+	for(std::thread& thread : threads) {
+		thread.join();
+	}
+
+	// Don't keep files that couldn't be read, so they are tried again
+	for(size_t i = 0; i < changed.size(); ++i) {
+		if(!is_read[i]) {
+			entries.erase(changed[i]);
+		}
+	}
+
+	if(!save(index_name, entries)) {
+		return false;
+	}
+
+	// Print the roms, then how long it took
+	size_t unsupported = 0;
+	for(const auto& pair : entries) {
+		const Entry& entry = pair.second;
+		char sha256[65];
+		for(size_t i = 0; i < entry.sha256.size(); ++i) {
+			snprintf(&sha256[i * 2], 3, "%02x", entry.sha256[i]);
+		}
+		if((entry.flags & IS_VALID) == 0) {
+			printf("%s  not a rom      %s\n", sha256, pair.first.c_str());
+			continue;
+		}
+		bool is_supported = (entry.flags & IS_MAPPER_SUPPORTED) != 0;
+		if(!is_supported) {
+			++unsupported;
+		}
+		printf("%s  mapper %3d%s  %s\n", sha256, entry.mapper, is_supported ? " " : "*", pair.first.c_str());
+	}
+
+	double ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+	printf("Indexed %zu roms, %zu with unsupported mappers marked *. Read %zu new or changed files in %.2f ms (threads: %zu)\n",
+		entries.size(), unsupported, changed.size(), ms, thread_count);
+	printf("Wrote the index to '%s'\n", index_name.c_str());
+	return true;
+}
+
+#endif
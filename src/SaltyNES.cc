@@ -34,9 +34,9 @@ void SaltyNES::init() {
 	nes->reset();
 }
 
-void SaltyNES::load_rom(string rom_name, vector<uint8_t>* rom_data, array<uint16_t, 0x2000>* save_ram) {
+void SaltyNES::load_rom(string rom_name, const uint8_t* rom_data, size_t rom_size, array<uint16_t, 0x2000>* save_ram) {
 	_rom_name = rom_name;
-	nes->load_rom_from_data(rom_name, rom_data, save_ram);
+	nes->load_rom_from_data(rom_name, rom_data, rom_size, save_ram);
 }
 
 void SaltyNES::run() {
@@ -20,10 +20,20 @@ Hosted at: https://github.com/workhorsy/SaltyNES
 #include <algorithm>
 #include <memory>
 #include <array>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
 #include <sys/time.h>
 
 #include "Color.h"
 #include "base64.h"
+#include "sha256sum.h"
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_audio.h>
@@ -38,14 +48,19 @@ using namespace std;
 
 // Forward declarations
 class IPapuChannel;
+class AllocCounter;
 class ByteBuffer;
 class ChannelDM;
 class ChannelNoise;
 class ChannelSquare;
 class ChannelTriangle;
+class ChromeTrace;
 class CPU;
 class CpuInfo;
+class CpuProfile;
+class CpuTrace;
 class FileLoader;
+class FrameTiming;
 class InputHandler;
 class Logger;
 class Mapper001;
@@ -64,8 +79,14 @@ class NES;
 class PaletteTable;
 class PAPU;
 class PPU;
+class PpuPipeline;
+class PpuRenderer;
+class Presenter;
 class Raster;
 class ROM;
+class RomArchive;
+class RomIndex;
+class Snapshot;
 class Tile;
 class SaltyNES;
 
@@ -122,6 +143,11 @@ public:
 	static bool disableSprites;
 	static bool palEmulation;
 	static bool enableSound;
+	static bool enableCpuTrace;
+	static int cpuProfileFrames;
+	static bool skipSameFrames;
+	static bool pipelinedRendering;
+	static int frameSkip;
 
 	static std::map<string, uint32_t> keycodes; //Java key codes
 	static std::map<string, string> controls; //vNES controls codes
@@ -129,6 +155,22 @@ public:
 	static std::map<int, SDL_Joystick*> joysticks;
 };
 
+// Only counts allocations on the thread that started counting:
+class AllocCounter {
+	static thread_local bool _is_counting;
+	static size_t _count;
+
+public:
+	static void start() { _count = 0; _is_counting = true; }
+	static void stop() { _is_counting = false; }
+	static size_t count() { return _count; }
+	static void count_allocation() {
+		if(_is_counting) {
+			++_count;
+		}
+	}
+};
+
 class ByteBuffer {
 public:
 	static const int BO_BIG_ENDIAN = 0;
@@ -143,6 +185,7 @@ public:
 
 	ByteBuffer(size_t size, const int byteOrdering);
 	ByteBuffer(vector<uint8_t>* content, const int byteOrdering);
+	ByteBuffer(const uint8_t* content, size_t size, const int byteOrdering);
 	void setExpandable(bool exp);
 	void setExpandBy(size_t expBy);
 	void setByteOrder(int byteOrder);
@@ -248,6 +291,8 @@ public:
 	int getLengthStatus();
 	int getIrqStatus();
 	void reset();
+	void stateLoad(ByteBuffer* buf);
+	void stateSave(ByteBuffer* buf);
 };
 
 
@@ -286,6 +331,8 @@ public:
 	bool isEnabled();
 	int getLengthStatus();
 	void reset();
+	void stateLoad(ByteBuffer* buf);
+	void stateSave(ByteBuffer* buf);
 };
 
 class ChannelSquare : public IPapuChannel {
@@ -332,6 +379,8 @@ public:
 	bool isEnabled();
 	int getLengthStatus();
 	void reset();
+	void stateLoad(ByteBuffer* buf);
+	void stateSave(ByteBuffer* buf);
 };
 
 class ChannelTriangle : public IPapuChannel {
@@ -365,6 +414,78 @@ public:
 	bool isEnabled();
 	void updateSampleCondition();
 	void reset();
+	void stateLoad(ByteBuffer* buf);
+	void stateSave(ByteBuffer* buf);
+};
+
+class ChromeTrace {
+public:
+	// Events each thread can have waiting for the writer:
+	static const size_t BUFFER_SIZE = 65536;
+	// Threads that can record events:
+	static const size_t MAX_THREADS = 16;
+
+	struct Event {
+		const char* name;
+		const char* arg_names[2];
+		int args[2];
+		uint64_t ticks;
+		char phase;
+	};
+
+	// Written by one thread, read by the writer thread:
+	struct ThreadBuffer {
+		array<Event, BUFFER_SIZE> events;
+		atomic<size_t> head;
+		atomic<size_t> tail;
+		atomic<bool> is_claimed;
+		size_t dropped;
+		int tid;
+	};
+
+	static atomic<bool> _is_on;
+	static FILE* _file;
+	static bool _first_event;
+	static uint64_t _start_ticks;
+	static atomic<bool> _stop_writer;
+	static std::thread _writer;
+	static std::mutex _buffers_mutex;
+	static array<ThreadBuffer*, MAX_THREADS> _buffers;
+	static atomic<size_t> _buffer_count;
+	static atomic<size_t> _session;
+	static atomic<size_t> _unregistered_dropped;
+
+	static bool init(string file_name);
+	static void close();
+	static void name_thread(const char* name);
+	static void reserve_thread(const char* name);
+	static ThreadBuffer* add_buffer(const char* name, bool is_claimed);
+	static void push(const char* name, char phase, const char* arg_name0, int arg0, const char* arg_name1, int arg1);
+	static void push_to(ThreadBuffer* buffer, const char* name, char phase, const char* arg_name0, int arg0, const char* arg_name1, int arg1);
+	static void flush();
+	static void write_loop();
+
+	static inline bool is_on() {
+		return _is_on.load(std::memory_order_relaxed);
+	}
+
+	static inline void begin(const char* name, const char* arg_name0 = nullptr, int arg0 = 0, const char* arg_name1 = nullptr, int arg1 = 0) {
+		if(is_on()) {
+			push(name, 'B', arg_name0, arg0, arg_name1, arg1);
+		}
+	}
+
+	static inline void end(const char* name) {
+		if(is_on()) {
+			push(name, 'E', nullptr, 0, nullptr, 0);
+		}
+	}
+
+	static inline void instant(const char* name, const char* arg_name0 = nullptr, int arg0 = 0, const char* arg_name1 = nullptr, int arg1 = 0) {
+		if(is_on()) {
+			push(name, 'i', arg_name0, arg0, arg_name1, arg1);
+		}
+	}
 };
 
 class CPU : public enable_shared_from_this<CPU> {
@@ -434,6 +555,10 @@ public:
 	bool stopRunning;
 	bool crash;
 
+	// Instruction trace and profile, only allocated when they are on:
+	shared_ptr<CpuTrace> trace;
+	shared_ptr<CpuProfile> profile;
+
 	explicit CPU();
 	shared_ptr<CPU> Init(shared_ptr<NES> nes);
 	~CPU();
@@ -443,8 +568,11 @@ public:
 	void reset();
 	void start();
 	void stop();
+	void saveRegisters();
 	void emulate_frame();
 	bool emulate();
+	template<bool TRACE, bool PROFILE> bool emulateInstruction();
+	template<bool TRACE, bool PROFILE> void emulateUntilRendered();
 	int load(int addr);
 	int load16bit(int addr);
 	void write(int addr, uint16_t val);
@@ -556,6 +684,138 @@ public:
 	static void setOp(int inst, int op, int addr, int size, int cycles);
 };
 
+class CpuProfile {
+public:
+	// How an instruction touches memory, besides fetching itself:
+	static const int ACCESS_NONE = 0;
+	static const int ACCESS_READ = 1;
+	static const int ACCESS_WRITE = 2;
+	static const int ACCESS_MODIFY = 3;
+	static const int ACCESS_PUSH = 4;
+	static const int ACCESS_PULL = 5;
+
+	array<int, 57> accessType;
+	array<int, 57> stackBytes;
+
+	// Frames per report:
+	int reportFrames;
+	int frames;
+
+	uint64_t instructions;
+	uint64_t cycles;
+	uint32_t pageCrossPenalties;
+	uint32_t branchesTaken;
+	uint32_t mapperWrites;
+	uint32_t oamDmaWrites;
+	array<uint32_t, 256> opcodes;
+	array<uint32_t, 13> addrModes;
+	array<uint32_t, 256> pageReads;
+	array<uint32_t, 256> pageWrites;
+	array<uint32_t, 8> ppuRegReads;
+	array<uint32_t, 8> ppuRegWrites;
+
+	explicit CpuProfile(int reportFrames);
+	void clear();
+	void countInstruction(int opcode, int opinf, int pc, int addr, int extraCycles, int cycleCount);
+	void countRead(int addr);
+	void countWrite(int addr);
+	void endFrame();
+	void report(FILE* out);
+};
+
+class CpuTrace {
+public:
+	// Number of instructions kept, must be a power of two:
+	static const size_t SIZE = 4096;
+	static const string DEFAULT_FILE;
+
+	struct Entry {
+		uint32_t cycle;
+		uint16_t pc;
+		uint8_t opcode;
+		uint8_t a;
+		uint8_t x;
+		uint8_t y;
+		uint8_t p;
+		uint8_t sp;
+	};
+
+	array<Entry, SIZE> ring;
+	size_t pos;
+	uint32_t cycles;
+
+	CpuTrace();
+	void clear();
+	bool dump(string file_name);
+	static bool format(string file_name, FILE* out);
+
+	inline void record(int pc, int opcode, int a, int x, int y, int p, int sp) {
+		Entry& e = ring[pos & (SIZE - 1)];
+		e.cycle = cycles;
+		e.pc = static_cast<uint16_t>(pc);
+		e.opcode = static_cast<uint8_t>(opcode);
+		e.a = static_cast<uint8_t>(a);
+		e.x = static_cast<uint8_t>(x);
+		e.y = static_cast<uint8_t>(y);
+		e.p = static_cast<uint8_t>(p);
+		e.sp = static_cast<uint8_t>(sp);
+		++pos;
+	}
+};
+
+class FrameTiming {
+public:
+	// Parts of a frame that are timed:
+	static const int PHASE_CPU = 0;
+	static const int PHASE_BACKGROUND = 1;
+	static const int PHASE_SPRITES = 2;
+	static const int PHASE_APU = 3;
+	static const int PHASE_PRESENT = 4;
+	static const int PHASE_SLEEP = 5;
+	static const int PHASE_FRAME = 6;
+	static const int PHASE_COUNT = 7;
+	// Frames kept for the percentiles:
+	static const size_t HISTORY = 600;
+
+	static bool _is_on;
+	static bool _print_report;
+	static array<uint64_t, PHASE_COUNT> _frame_ticks;
+	static array<array<float, HISTORY>, PHASE_COUNT> _history;
+	static array<float, HISTORY> _sorted;
+	static size_t _history_pos;
+	static size_t _history_count;
+	static uint64_t _frame_start;
+	static int _frames_since_report;
+	static atomic<uint32_t> _bg_lines;
+	static atomic<uint32_t> _bg_lines_reused;
+
+	static void init(bool print_report);
+	static void end_frame();
+	static float percentile(int phase, float p);
+	static string phase_name(int phase);
+	static void report(FILE* out);
+
+	static inline uint64_t start() {
+		return _is_on ? SDL_GetPerformanceCounter() : 0;
+	}
+
+	static inline void stop(int phase, uint64_t start) {
+		if(_is_on) {
+			_frame_ticks[phase] += SDL_GetPerformanceCounter() - start;
+		}
+	}
+
+	// Counts a background line that was drawn, or reused from the last frame:
+	static inline void count_bg_line(bool is_reused) {
+		if(_is_on) {
+			_bg_lines.fetch_add(1, std::memory_order_relaxed);
+			if(is_reused) {
+				_bg_lines_reused.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+	}
+};
+
 class InputHandler : public enable_shared_from_this<InputHandler> {
 public:
 	static const float AXES_DEAD_ZONE;
@@ -564,7 +824,6 @@ public:
 	string _gamepad_product_id;
 	bool _is_gamepad_used;
 	bool _is_keyboard_used;
-	map<string, bool> _is_input_pressed;
 	map<string, vector<size_t> > _input_map_button;
 	map<string, vector<size_t> > _input_map_axes_pos;
 	map<string, vector<size_t> > _input_map_axes_neg;
@@ -586,32 +845,34 @@ public:
 	// Key count:
 	static const int NUM_KEYS = 8;
 
+	array<bool, NUM_KEYS> _is_input_pressed;
+
 	void key_down(uint32_t key) {
 		_is_gamepad_used = false;
 		_is_keyboard_used = true;
 		switch(key) {
-			case(38): _is_input_pressed["up"] = true; break; // up = 38
-			case(37): _is_input_pressed["left"] = true; break; // left = 37
-			case(40): _is_input_pressed["down"] = true; break; // down = 40
-			case(39): _is_input_pressed["right"] = true; break; // right = 39
-			case(13): _is_input_pressed["start"] = true; break; // enter = 13
-			case(17): _is_input_pressed["select"] = true; break; // ctrl = 17
-			case(90): _is_input_pressed["b"] = true; break; // z = 90
-			case(88): _is_input_pressed["a"] = true; break; // x = 88
+			case(38): _is_input_pressed[KEY_UP] = true; break; // up = 38
+			case(37): _is_input_pressed[KEY_LEFT] = true; break; // left = 37
+			case(40): _is_input_pressed[KEY_DOWN] = true; break; // down = 40
+			case(39): _is_input_pressed[KEY_RIGHT] = true; break; // right = 39
+			case(13): _is_input_pressed[KEY_START] = true; break; // enter = 13
+			case(17): _is_input_pressed[KEY_SELECT] = true; break; // ctrl = 17
+			case(90): _is_input_pressed[KEY_B] = true; break; // z = 90
+			case(88): _is_input_pressed[KEY_A] = true; break; // x = 88
 		}
 	}
 	void key_up(uint32_t key) {
 		_is_gamepad_used = false;
 		_is_keyboard_used = true;
 		switch(key) {
-			case(38): _is_input_pressed["up"] = false; break; // up = 38
-			case(37): _is_input_pressed["left"] = false; break; // left = 37
-			case(40): _is_input_pressed["down"] = false; break; // down = 40
-			case(39): _is_input_pressed["right"] = false; break; // right = 39
-			case(13): _is_input_pressed["start"] = false; break; // enter = 13
-			case(17): _is_input_pressed["select"] = false; break; // ctrl = 17
-			case(90): _is_input_pressed["b"] = false; break; // z = 90
-			case(88): _is_input_pressed["a"] = false; break; // x = 88
+			case(38): _is_input_pressed[KEY_UP] = false; break; // up = 38
+			case(37): _is_input_pressed[KEY_LEFT] = false; break; // left = 37
+			case(40): _is_input_pressed[KEY_DOWN] = false; break; // down = 40
+			case(39): _is_input_pressed[KEY_RIGHT] = false; break; // right = 39
+			case(13): _is_input_pressed[KEY_START] = false; break; // enter = 13
+			case(17): _is_input_pressed[KEY_SELECT] = false; break; // ctrl = 17
+			case(90): _is_input_pressed[KEY_B] = false; break; // z = 90
+			case(88): _is_input_pressed[KEY_A] = false; break; // x = 88
 		}
 	}
 
@@ -675,6 +936,7 @@ public:
 	int joy2StrobeState;
 	int joypadLastWrite;
 	bool mousePressed;
+	bool zapperUsed;
 	bool gameGenieActive;
 	int mouseX;
 	int mouseY;
@@ -687,6 +949,8 @@ public:
 	void base_init(shared_ptr<NES> nes);
 	void stateLoad(ByteBuffer* buf);
 	void stateSave(ByteBuffer* buf);
+	virtual void mapperInternalStateLoad(ByteBuffer* buf);
+	virtual void mapperInternalStateSave(ByteBuffer* buf);
 	void base_mapperInternalStateLoad(ByteBuffer* buf);
 	void base_mapperInternalStateSave(ByteBuffer* buf);
 	void setGameGenieState(bool enable);
@@ -903,6 +1167,8 @@ public:
 class NES : public enable_shared_from_this<NES> {
 public:
 	bool _is_paused;
+	// Set to write a snapshot after the frame:
+	bool _is_snapshot_wanted;
 	shared_ptr<CPU> cpu;
 	shared_ptr<PPU> ppu;
 	shared_ptr<PAPU> papu;
@@ -929,15 +1195,15 @@ public:
 	void dumpRomMemory(ofstream* writer);
 	void dumpCPUMemory(ofstream* writer);
 	void setGameGenieState(bool enable);
-	shared_ptr<CPU> getCpu();
-	shared_ptr<PPU> getPpu();
-	shared_ptr<PAPU> getPapu();
-	shared_ptr<Memory> getCpuMemory();
-	shared_ptr<Memory> getPpuMemory();
-	shared_ptr<Memory> getSprMemory();
-	shared_ptr<ROM> getRom();
-	shared_ptr<MapperDefault> getMemoryMapper();
-	bool load_rom_from_data(string rom_name, vector<uint8_t>* data, array<uint16_t, 0x2000>* save_ram);
+	const shared_ptr<CPU>& getCpu();
+	const shared_ptr<PPU>& getPpu();
+	const shared_ptr<PAPU>& getPapu();
+	const shared_ptr<Memory>& getCpuMemory();
+	const shared_ptr<Memory>& getPpuMemory();
+	const shared_ptr<Memory>& getSprMemory();
+	const shared_ptr<ROM>& getRom();
+	const shared_ptr<MapperDefault>& getMemoryMapper();
+	bool load_rom_from_data(string rom_name, const uint8_t* data, size_t size, array<uint16_t, 0x2000>* save_ram);
 	void reset();
 	void enableSound(bool enable);
 //	void setFramerate(int rate);
@@ -948,6 +1214,8 @@ public:
 	static int curTable[64];
 	static int origTable[64];
 	static int emphTable[8][64];
+	// emphTable with the hue, saturation, lightness and contrast applied:
+	static int adjTable[8][64];
 
 	int currentEmph;
 	int currentHue, currentSaturation, currentLightness, currentContrast;
@@ -1101,7 +1369,7 @@ public:
 class Tile {
 public:
 	// Tile data:
-	array<int, 64> pix;
+	array<uint8_t, 64> pix;
 	int fbIndex;
 	int tIndex;
 	int x, y;
@@ -1112,32 +1380,112 @@ public:
 	int c;
 	bool initialized;
 	array<bool, 8> opaque;
+	// Opaque pixels in each row, with the left pixel in the top bit:
+	array<uint8_t, 8> rowMask;
 
 	Tile();
 	void setBuffer(vector<uint16_t>* scanline);
 	void setScanline(int sline, uint16_t b1, uint16_t b2);
 	void renderSimple(int dx, int dy, vector<int>* fBuffer, int palAdd, int* palette);
 	void renderSmall(int dx, int dy, vector<int>* buffer, int palAdd, int* palette);
-	void render(int srcx1, int srcy1, int srcx2, int srcy2, int dx, int dy, array<int, 256 * 240>* fBuffer, int palAdd, array<int, 16>* palette, bool flipHorizontal, bool flipVertical, int pri, array<int, 256 * 240>* priTable);
+	void render(int srcx1, int srcy1, int srcx2, int srcy2, int dx, int dy, array<uint8_t, 256 * 240>* fBuffer, int palAdd, array<uint8_t, 16>* palette, bool flipHorizontal, bool flipVertical, int pri, array<uint8_t, 256 * 240>* priTable);
+	void renderRow(const uint8_t* src, uint8_t* dest, uint8_t* dpri, int palAdd, array<uint8_t, 16>* palette, bool flipHorizontal, int pri);
 	bool isTransparent(int x, int y);
 	void dumpData(string file);
 	void stateSave(ByteBuffer* buf);
 	void stateLoad(ByteBuffer* buf);
 };
 
+class PpuRenderer {
+public:
+	// The sprite data used for drawing, decoded from sprite RAM:
+	struct Sprites {
+		array<int, 64> sprX;				// X coordinate
+		array<int, 64> sprY;				// Y coordinate
+		array<int, 64> sprTile;			// Tile Index (into pattern table)
+		array<int, 64> sprCol;			// Upper two bits of color
+		array<bool, 64> vertFlip;		// Vertical Flip
+		array<bool, 64> horiFlip;		// Horizontal Flip
+		array<bool, 64> bgPriority;	// Background priority
+		// Sprites on each screen line, one bit per sprite:
+		array<uint64_t, 256> spriteLines;
+		uint64_t spritesBehindBg;		// One bit per sprite with background priority
+	};
+
+	// The tiles fetched for one background line:
+	struct BgLine {
+		int scan;			// Screen line, or -1 if nothing was fetched
+		int fineX;			// Fine horizontal scroll
+		int fineY;			// Row inside the tiles
+		bool toScreen;		// Drawn to the screen instead of the background buffer
+		array<uint16_t, 32> tiles;
+		array<uint8_t, 32> attribs;
+	};
+
+	// A background line drawn before, and what it was drawn from:
+	struct LineCache {
+		BgLine line;
+		array<uint8_t, 16> palette;
+		uint32_t tileVersion;
+		bool isValid;
+	};
+
+	array<uint8_t, 256 * 240> screen;
+	array<uint8_t, 256 * 240> bgbuffer;
+	// Low 7 bits are the sprite drawn, the top bit is set if the
+	// background was drawn:
+	array<uint8_t, 256 * 240> pixrendered;
+	// What is drawn from:
+	array<Tile, 512>* tiles;
+	array<uint8_t, 16>* imgPalette;
+	array<uint8_t, 16>* sprPalette;
+	Sprites* sprites;
+	// Background lines in bgbuffer, and their pixrendered bits. A line drawn
+	// from the same tiles and palette as last time is reused:
+	array<LineCache, 240> lineCache;
+	array<uint8_t, 256 * 240> bgRendered;
+	// The version of each tile is bumped when it changes:
+	array<uint32_t, 512> tileVersions;
+	uint32_t tileVersion;
+
+	PpuRenderer();
+	void startFrame(uint8_t bgColor);
+	void tileChanged(size_t index);
+	void invalidateLines();
+	bool isLineCached(const BgLine& line);
+	void drawBgLine(const BgLine& line);
+	void drawBgTileRow(uint8_t* dest, uint8_t* rendered, const uint8_t* pix, int att);
+	void mergeBg(int startScan, int scanCount);
+	void drawSprites(int startscan, int scancount, bool bgPri, int spriteSize, int patternTable);
+	void drawCrosshair(int x, int y, uint8_t color);
+};
+
 class PPU : public enable_shared_from_this<PPU> {
 public:
-	shared_ptr<NES> nes;
-	static const size_t UNDER_SCAN;
-	int _zoom;
-	struct timeval _frame_start;
-	struct timeval _frame_end;
-	double _ticks_since_second;
-	uint32_t frameCounter;
-	shared_ptr<Memory> ppuMem;
-	shared_ptr<Memory> sprMem;
-	// Rendering Options:
-	bool showSpr0Hit;
+	// Hot state, used every PPU cycle or scanline. It is kept together at
+	// the start of the object, so it only takes up a few cache lines:
+	int cycles;
+	int curX;
+	int scanline;
+	// VBlank extension for PAL emulation:
+	int vblankAdd;
+	int lastRenderedScanline;
+	int mapperIrqCounter;
+	int spr0HitX;	// Sprite #0 hit X coordinate
+	int spr0HitY;	// Sprite #0 hit Y coordinate
+	bool hitSpr0;
+	bool scanlineAlreadyRendered;
+	bool requestEndFrame;
+	bool nmiOk;
+	int nmiCounter;
+	bool dummyCycleToggle;
+	bool validTileData;
+	// Set when this frame is not drawn, only 1 of every
+	// Globals::frameSkip frames is:
+	bool isSkippingFrame;
+	// The last line sprite 0 has been drawn on this frame:
+	int spr0DrawnTo;
+
 	// Control Flags Register 1:
 	int f_nmiOnVblank; // NMI on VBlank. 0=disable, 1=enable
 	int f_spriteSize; // Sprite size. 0=8x8, 1=8x16
@@ -1157,16 +1505,6 @@ public:
 	int STATUS_SLSPRITECOUNT;
 	int STATUS_SPRITE0HIT;
 	int STATUS_VBLANK;
-	// VRAM I/O:
-	int vramAddress;
-	int vramTmpAddress;
-	uint16_t vramBufferedReadValue;
-	bool firstWrite; 		// VRAM/Scroll Hi/Lo latch
-	array<int, 0x8000> vramMirrorTable; // Mirroring Lookup Table.
-	int i;
-
-	// SPR-RAM I/O:
-	uint16_t sramAddress; // 8-bit only.
 
 	// Counters:
 	int cntFV;
@@ -1184,71 +1522,83 @@ public:
 	int regFH;
 	int regS;
 
-	// VBlank extension for PAL emulation:
-	int vblankAdd;
-	int curX;
-	int scanline;
-	int lastRenderedScanline;
-	int mapperIrqCounter;
+	// VRAM I/O:
+	int vramAddress;
+	int vramTmpAddress;
+	uint16_t vramBufferedReadValue;
+	bool firstWrite; 		// VRAM/Scroll Hi/Lo latch
+
+	// SPR-RAM I/O:
+	uint16_t sramAddress; // 8-bit only.
+
+	// Cold state, and the big tables:
+	shared_ptr<NES> nes;
+	static const size_t UNDER_SCAN;
+	int _zoom;
+	struct timeval _frame_start;
+	struct timeval _frame_end;
+	double _ticks_since_second;
+	uint32_t frameCounter;
+	shared_ptr<Memory> ppuMem;
+	shared_ptr<Memory> sprMem;
+	// Rendering Options:
+	bool showSpr0Hit;
+	// Frames not drawn since the last one that was:
+	int skippedFrames;
+	// The address each nametable page is mirrored to:
+	array<int, 4> nametablePages;
+
 	// Sprite data:
-	array<int, 64> sprX;				// X coordinate
-	array<int, 64> sprY;				// Y coordinate
-	array<int, 64> sprTile;			// Tile Index (into pattern table)
-	array<int, 64> sprCol;			// Upper two bits of color
-	array<bool, 64> vertFlip;		// Vertical Flip
-	array<bool, 64> horiFlip;		// Horizontal Flip
-	array<bool, 64> bgPriority;	// Background priority
-	int spr0HitX;	// Sprite #0 hit X coordinate
-	int spr0HitY;	// Sprite #0 hit Y coordinate
-	bool hitSpr0;
+	PpuRenderer::Sprites spr;
+	bool spriteLinesDirty;
+	int spriteLinesHeight;
 
 	// Tiles:
 	array<Tile, 512> ptTile;
+	// The tile being written through $2007, and its rows written. It is
+	// decoded once the writes move on, or the tiles are used:
+	int pendingTile;
+	uint8_t pendingRows;
 	// Name table data:
 	array<int, 4> ntable1;
 	array<NameTable, 4> nameTable;
 	int currentMirroring;
 
-	// Palette data:
-	array<int, 16> sprPalette;
-	array<int, 16> imgPalette;
-	// Misc:
-	bool scanlineAlreadyRendered;
-	bool requestEndFrame;
-	bool nmiOk;
-	int nmiCounter;
-	uint16_t tmp;
-	bool dummyCycleToggle;
+	// Palette data, as screen color indexes. There is a copy for each
+	// emphasis slot, in color and in monochrome, all updated when an entry
+	// is written. Changing those only changes which copies are used:
+	array<array<uint8_t, 16>, 6> sprPalettes;
+	array<array<uint8_t, 16>, 6> imgPalettes;
+	array<uint8_t, 16>* sprPalette;
+	array<uint8_t, 16>* imgPalette;
+	// Color emphasis settings used this frame. Screen color indexes are
+	// the NES color in the low 6 bits, and the emphasis slot in the top 2:
+	array<int, 3> emphSlots;
+	int emphSlotCount;
+	int emphSlot;
+	static const uint8_t COLOR_BLACK = 0xC0;
+	static const uint8_t COLOR_SPR0 = 0xC1;
+	static const uint8_t COLOR_SPR0_HIT = 0xC2;
 
-	// Vars used when updating regs/address:
-	int address, b1, b2;
 	// Variables used when rendering:
-	array<int, 32> attrib;
-	array<int, 256 * 240> bgbuffer;
-	array<int, 256 * 240> pixrendered;
 	//vector<int> dummyPixPriTable;
-	array<int, 64>* tpix;
 	bool requestRenderAll;
-	bool validTileData;
-	int att;
-	array<Tile*, 32> scantile;
-	Tile* t;
-	// These are temporary variables used in rendering and sound procedures.
-	// Their states outside of those procedures can be ignored.
-	int curNt;
-	int destIndex;
-	int x, y, sx;
-	int si, ei;
-	int tile;
-	int col;
-	int baseTile;
-	int tscanoffset;
-	int srcy1, srcy2;
-	int bufferSize, available;
-	int cycles;
-	array<int, 256 * 240> _screen_buffer;
-
-	array<int, 256 * 240>* get_screen_buffer();
+	// The last background line fetched, its tiles are reused
+	// while validTileData is set:
+	PpuRenderer::BgLine bgLine;
+	// Draws the frame, unless drawing is pipelined. It has its own
+	// allocation, as its buffers are far bigger than the rest of the PPU:
+	shared_ptr<PpuRenderer> renderer;
+	// Records the drawing for a worker thread, when pipelined:
+	shared_ptr<PpuPipeline> pipeline;
+	// Changes not yet recorded for the pipeline:
+	array<uint64_t, 8> changedTiles;
+	bool changedPalettes;
+	bool changedSprites;
+
+	uint32_t get_screen_color(int x, int y);
+	uint32_t screenColor(uint8_t index);
+	void setEmphasisSlot(int emph);
 	vector<int>* get_pattern_buffer();
 	vector<int>* get_name_buffer();
 	vector<int>* get_img_palette_buffer();
@@ -1258,11 +1608,12 @@ public:
 	~PPU();
 	void init();
 	void setMirroring(int mirroring);
-	void defineMirrorRegion(size_t fromStart, size_t toStart, size_t size);
 	bool emulateCycles();
+	int cyclesToNextEvent();
 	void startVBlank();
 	void endScanline();
 	void startFrame();
+	void markSpr0Drawn(int startscan, int scancount);
 	void endFrame();
 	void updateControlReg1(int value);
 	void updateControlReg2(int value);
@@ -1281,32 +1632,157 @@ public:
 	void regsToAddress();
 	void cntsToAddress();
 	void incTileCounter(int count);
+	int mirrorAddress(int address);
 	uint16_t mirroredLoad(int address);
 	void mirroredWrite(int address, uint16_t value);
 	void triggerRendering();
 	void renderFramePartially(int startScan, int scanCount);
-	void renderBgScanline(array<int, 256 * 240>* buffer, int scan);
+	void renderBgScanline(bool toScreen, int scan);
+	void updateSpriteLines();
 	void renderSpritesPartially(int startscan, int scancount, bool bgPri);
+	void recordChanges();
+	void tilesChanged(size_t first, size_t count);
+	void stopPipeline();
+	uint8_t renderedMask(int scan, int x);
 	bool checkSprite0(int scan);
+	static uint8_t reverseBits(uint8_t b);
 	void renderPattern();
 	void renderNameTables();
 	void renderPalettes();
 	void writeMem(int address, uint16_t value);
 	void updatePalettes();
+	void updatePaletteEntry(int index, uint16_t value);
+	void selectPalettes();
+	bool isPaletteUnchanged(int address, uint16_t value);
 	void patternWrite(int address, uint16_t value);
+	void deferPatternWrite(int address);
+	void decodePendingTile();
 	void patternWrite(int address, vector<uint16_t>* value, size_t offset, size_t length);
 	void invalidateFrameCache();
 	void nameTableWrite(int index, int address, uint16_t value);
 	void attribTableWrite(int index, int address, uint16_t value);
 	void spriteRamWriteUpdate(int address, uint16_t value);
+	void spriteRamUpdate(int first, int count);
+	void decodeSpriteByte(int address, uint16_t value);
 	void doNMI();
 	int statusRegsToInt();
-	void statusRegsFromInt(int n);
+	void statusRegsFromInt(int n, int version);
 	void stateLoad(ByteBuffer* buf);
 	void stateSave(ByteBuffer* buf);
 	void reset();
 };
 
+class PpuPipeline {
+public:
+	// What the PPU records, each followed by its data in the log:
+	enum Command {
+		CMD_START_FRAME,
+		CMD_BG_LINE,
+		CMD_MERGE_BG,
+		CMD_SPRITES,
+		CMD_CROSSHAIR,
+		CMD_TILE,
+		CMD_PALETTES,
+		CMD_SPRITE_DATA,
+		CMD_END_FRAME
+	};
+
+	struct MergeBg {
+		int startScan;
+		int scanCount;
+	};
+	struct DrawSprites {
+		int startscan;
+		int scancount;
+		bool bgPri;
+		int spriteSize;
+		int patternTable;
+	};
+	struct Crosshair {
+		int x;
+		int y;
+		uint8_t color;
+	};
+	struct TileData {
+		uint16_t index;
+		array<uint8_t, 64> pix;
+	};
+	struct Palettes {
+		array<uint8_t, 16> img;
+		array<uint8_t, 16> spr;
+	};
+
+	// Room reserved for each frame's log:
+	static const size_t LOG_SIZE = 512 * 1024;
+
+	vector<uint8_t> _recording;
+	vector<uint8_t> _replaying;
+	bool _is_replaying;
+	bool _stop;
+	std::thread _thread;
+	std::mutex _mutex;
+	std::condition_variable _wake;
+
+	// The worker's copy of what is drawn from:
+	PpuRenderer _renderer;
+	array<Tile, 512> _tiles;
+	array<uint8_t, 16> _img_palette;
+	array<uint8_t, 16> _spr_palette;
+	PpuRenderer::Sprites _sprites;
+
+	PpuPipeline();
+	~PpuPipeline();
+	void start();
+	void stop();
+	template<typename T>
+	void record(Command command, const T& data) {
+		size_t pos = _recording.size();
+		_recording.resize(pos + 1 + sizeof(T));
+		_recording[pos] = static_cast<uint8_t>(command);
+		memcpy(&_recording[pos + 1], &data, sizeof(T));
+	}
+	void submit();
+	void replay_loop();
+	void replay(const vector<uint8_t>& log);
+};
+
+class Presenter {
+public:
+	// A finished frame, as color indexes and the colors they are shown as:
+	struct Frame {
+		array<uint8_t, 256 * 240> indexes;
+		array<uint32_t, 256> colors;
+	};
+
+	// Set in _ready when the frame there has not been shown yet:
+	static const int NEW_FRAME = 4;
+
+	static bool _is_threaded;
+	static bool _is_headless;
+	static array<Frame, 3> _frames;
+	static int _back;
+	static int _front;
+	static atomic<int> _ready;
+	static atomic<int> _renderer_state;
+	static atomic<bool> _stop;
+	static std::thread _thread;
+	static std::mutex _wake_mutex;
+	static std::condition_variable _wake;
+	static uint64_t _last_hash;
+
+	static bool init(bool is_threaded);
+	static void init_headless();
+	static void close();
+	static bool create_renderer();
+	static Frame& back_frame();
+	static void publish();
+	static void hand_off();
+	static void draw_ready();
+	static void present_loop();
+	static void draw(const Frame& frame);
+	static uint64_t hash_frame(const Frame& frame);
+};
+
 class Raster {
 public:
 	vector<int>* data;
@@ -1331,6 +1807,16 @@ public:
 	}
 };
 
+// Decodes roms stored in .gz and .zip files:
+class RomArchive {
+public:
+	// Largest rom decoded, so a broken file can't use up all the memory:
+	static const size_t MAX_SIZE = 16 * 1024 * 1024;
+
+	static bool is_archive(const uint8_t* data, size_t size);
+	static bool decode(const uint8_t* data, size_t size, vector<uint8_t>* out, const function<void(const uint8_t*, size_t)>& on_data);
+};
+
 class ROM : public enable_shared_from_this<ROM> {
 public:
 	// Mirroring types:
@@ -1350,7 +1836,9 @@ public:
 	vector<array<uint16_t, 16384>> rom;
 	vector<array<uint16_t, 4096>> vrom;
 	array<uint16_t, 0x2000>* saveRam;
+	// The tiles of each VROM bank, decoded the first time it is mapped:
 	vector<array<Tile, 256>> vromTile;
+	vector<bool> vromTileDecoded;
 	shared_ptr<NES> nes;
 	size_t romCount;
 	size_t vromCount;
@@ -1367,9 +1855,12 @@ public:
 	explicit ROM();
 	shared_ptr<ROM> Init(shared_ptr<NES> nes);
 	~ROM();
-	string sha256sum(uint8_t* data, size_t length);
+	string sha256sum(const uint8_t* data, size_t length);
+	string sha256sum(SHA256Context* ctx);
 	string getmapperName();
-	void load_from_data(string file_name, vector<uint8_t>* data, array<uint16_t, 0x2000>* save_ram);
+	bool readImage(const uint8_t** data, size_t* size, vector<uint8_t>* decoded);
+	bool readHeader(const uint8_t* data, size_t size);
+	void load_from_data(string file_name, const uint8_t* data, size_t size, array<uint16_t, 0x2000>* save_ram);
 	bool isValid();
 	int getRomBankCount();
 	int getVromBankCount();
@@ -1377,6 +1868,7 @@ public:
 	array<uint16_t, 16384>* getRomBank(int bank);
 	array<uint16_t, 4096>* getVromBank(int bank);
 	array<Tile, 256>* getVromBankTiles(int bank);
+	void decodeVromBank(int bank);
 	int getMirroringType();
 	size_t getMapperType();
 	string getMapperName();
@@ -1392,6 +1884,46 @@ public:
 	void closeRom();
 };
 
+// Indexes the roms in a directory, into a file that is reused next time:
+class RomIndex {
+public:
+	static const string FILE_NAME;
+
+	// Flags for each rom:
+	static const uint8_t IS_VALID = 1;
+	static const uint8_t HAS_BATTERY_RAM = 2;
+	static const uint8_t HAS_TRAINER = 4;
+	static const uint8_t IS_FOUR_SCREEN = 8;
+	static const uint8_t IS_MAPPER_SUPPORTED = 16;
+
+	// Written to the index as is, after the magic and count:
+	struct Entry {
+		uint64_t size;
+		int64_t mtime;
+		array<uint8_t, 32> sha256;
+		uint16_t mapper;
+		uint16_t rom_count;
+		uint16_t vrom_count;
+		uint8_t mirroring;
+		uint8_t flags;
+	};
+
+	static bool index(string dir);
+	static void find_roms(string root, string prefix, map<string, Entry>* found);
+	static bool read_rom(string file_name, Entry* entry);
+	static bool load(string file_name, map<string, Entry>* entries);
+	static bool save(string file_name, const map<string, Entry>& entries);
+};
+
+// Suspends the machine to a file named after the rom's sha256, and resumes it:
+class Snapshot {
+public:
+	static string file_name(const string& sha256);
+	static bool exists(const shared_ptr<NES>& nes);
+	static bool save(const shared_ptr<NES>& nes);
+	static bool load(const shared_ptr<NES>& nes);
+};
+
 class SaltyNES {
 public:
 	int samplerate;
@@ -1402,7 +1934,7 @@ public:
 	SaltyNES();
 	~SaltyNES();
 	void init();
-	void load_rom(string rom_name, vector<uint8_t>* rom_data, array<uint16_t, 0x2000>* save_ram);
+	void load_rom(string rom_name, const uint8_t* rom_data, size_t rom_size, array<uint16_t, 0x2000>* save_ram);
 	void run();
 	void stop();
 	void readParams();
@@ -0,0 +1,139 @@
+/*
+Copyright (c) 2012-2017 Matthew Brennan Jones <matthew.brennan.jones@gmail.com>
+A NES emulator in WebAssembly. Based on vNES.
+Licensed under GPLV3 or later
+Hosted at: https://github.com/workhorsy/SaltyNES
+*/
+
+/*
+This class suspends the whole machine to disk, so a game can be resumed at the
+frame it was left on, instead of booting it again. The state is what
+NES::stateSave writes, and is written to and read from a memory mapped file
+named after the rom's sha256. Snapshots are only taken between frames.
+*/
+
+#include "SaltyNES.h"
+
+#ifdef DESKTOP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char SNAPSHOT_MAGIC[8] = { 'S', 'N', 'S', 'N', 'A', 'P', '0', '1' };
+
+// The magic, the rom's sha256 in hex, and the size of the state:
+static const size_t HEADER_SIZE = sizeof(SNAPSHOT_MAGIC) + 64 + sizeof(uint32_t);
+
+string Snapshot::file_name(const string& sha256) {
+	return sha256 + ".snapshot";
+}
+
+bool Snapshot::exists(const shared_ptr<NES>& nes) {
+	struct stat info;
+	return stat(file_name(nes->getRom()->_sha256).c_str(), &info) == 0;
+}
+
+// Writes the state to a temporary file, then moves it over the old snapshot,
+// so a crash can't leave half a snapshot:
+bool Snapshot::save(const shared_ptr<NES>& nes) {
+	uint64_t start = SDL_GetPerformanceCounter();
+	string name = file_name(nes->getRom()->_sha256);
+	string temp_name = name + ".tmp";
+
+	ByteBuffer buf(0x40000, ByteBuffer::BO_BIG_ENDIAN);
+	nes->stateSave(&buf);
+	uint32_t state_size = static_cast<uint32_t>(buf.getPos());
+	size_t size = HEADER_SIZE + state_size;
+
+	int fd = open(temp_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd == -1 || ftruncate(fd, size) != 0) {
+		fprintf(stderr, "Couldn't write snapshot '%s': %s\n", temp_name.c_str(), strerror(errno));
+		if(fd != -1) {
+			close(fd);
+		}
+		return false;
+	}
+	void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(mapping == MAP_FAILED) {
+		fprintf(stderr, "Couldn't write snapshot '%s': %s\n", temp_name.c_str(), strerror(errno));
+		remove(temp_name.c_str());
+		return false;
+	}
+
+	// The buffer holds a byte in each uint16_t
+	uint8_t* data = static_cast<uint8_t*>(mapping);
+	memcpy(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	memcpy(data + sizeof(SNAPSHOT_MAGIC), nes->getRom()->_sha256.data(), 64);
+	memcpy(data + sizeof(SNAPSHOT_MAGIC) + 64, &state_size, sizeof(state_size));
+	uint8_t* state = data + HEADER_SIZE;
+	for(size_t i = 0; i < state_size; ++i) {
+		state[i] = static_cast<uint8_t>(buf.buf[i]);
+	}
+	munmap(mapping, size);
+
+	if(rename(temp_name.c_str(), name.c_str()) != 0) {
+		fprintf(stderr, "Couldn't write snapshot '%s': %s\n", name.c_str(), strerror(errno));
+		remove(temp_name.c_str());
+		return false;
+	}
+
+	double ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+	printf("Wrote snapshot '%s' in %.2f ms\n", name.c_str(), ms);
+	return true;
+}
+
+// Loads the snapshot for the rom, if there is one. This must be done before
+// the CPU is started, which takes its registers from the state. If it fails
+// after the state was started on, the machine is left half loaded, and the
+// rom has to be loaded again:
+bool Snapshot::load(const shared_ptr<NES>& nes) {
+	string name = file_name(nes->getRom()->_sha256);
+	int fd = open(name.c_str(), O_RDONLY);
+	if(fd == -1) {
+		return false;
+	}
+	struct stat info;
+	if(fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < HEADER_SIZE) {
+		fprintf(stderr, "Not a snapshot file: '%s'\n", name.c_str());
+		close(fd);
+		return false;
+	}
+	size_t size = static_cast<size_t>(info.st_size);
+	void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(mapping == MAP_FAILED) {
+		fprintf(stderr, "Couldn't read snapshot '%s': %s\n", name.c_str(), strerror(errno));
+		return false;
+	}
+
+	// Make sure it is a whole snapshot, of this rom
+	const uint8_t* data = static_cast<const uint8_t*>(mapping);
+	uint32_t state_size = 0;
+	memcpy(&state_size, data + sizeof(SNAPSHOT_MAGIC) + 64, sizeof(state_size));
+	if(memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+		memcmp(data + sizeof(SNAPSHOT_MAGIC), nes->getRom()->_sha256.data(), 64) != 0 ||
+		HEADER_SIZE + state_size != size) {
+		fprintf(stderr, "Not a snapshot file for this rom: '%s'\n", name.c_str());
+		munmap(mapping, size);
+		return false;
+	}
+
+	ByteBuffer buf(data + HEADER_SIZE, state_size, ByteBuffer::BO_BIG_ENDIAN);
+	munmap(mapping, size);
+	if(!nes->stateLoad(&buf) || buf.hasHadErrors() || buf.getPos() != state_size) {
+		fprintf(stderr, "Couldn't load snapshot '%s'\n", name.c_str());
+		return false;
+	}
+
+	// The next frame was started before the snapshot was taken, on a screen
+	// that isn't in the state, so start it again
+	nes->getPpu()->startFrame();
+
+	printf("Resumed from snapshot '%s'\n", name.c_str());
+	return true;
+}
+
+#endif
@@ -26,6 +26,7 @@ Tile::Tile() {
 	c = 0;
 	initialized = false;
 	opaque.fill(false);
+	rowMask.fill(0);
 }
 
 void Tile::setBuffer(vector<uint16_t>* scanline) {
@@ -37,6 +38,7 @@ void Tile::setBuffer(vector<uint16_t>* scanline) {
 void Tile::setScanline(int sline, uint16_t b1, uint16_t b2) {
 	initialized = true;
 	tIndex = sline << 3;
+	rowMask[sline] = static_cast<uint8_t>(b1 | b2);
 	for(x = 0; x < 8; ++x) {
 		pix[tIndex + x] = ((b1 >> (7 - x)) & 1) + (((b2 >> (7 - x)) & 1) << 1);
 		if(pix[tIndex + x] == 0) {
@@ -82,119 +84,81 @@ void Tile::renderSmall(int dx, int dy, vector<int>* buffer, int palAdd, int* pal
 
 }
 
-void Tile::render(int srcx1, int srcy1, int srcx2, int srcy2, int dx, int dy, array<int, 256 * 240>* fBuffer, int palAdd, array<int, 16>* palette, bool flipHorizontal, bool flipVertical, int pri, array<int, 256 * 240>* priTable) {
+void Tile::render(int srcx1, int srcy1, int srcx2, int srcy2, int dx, int dy, array<uint8_t, 256 * 240>* fBuffer, int palAdd, array<uint8_t, 16>* palette, bool flipHorizontal, bool flipVertical, int pri, array<uint8_t, 256 * 240>* priTable) {
 	if(dx < -7 || dx >= 256 || dy < -7 || dy >= 240) {
 		return;
 	}
 
-	w = srcx2 - srcx1;
-	h = srcy2 - srcy1;
-
-	if(dx < 0) {
-		srcx1 -= dx;
-	}
-	if(dx + srcx2 >= 256) {
-		srcx2 = 256 - dx;
-	}
-
-	if(dy < 0) {
-		srcy1 -= dy;
-	}
-	if(dy + srcy2 >= 240) {
-		srcy2 = 240 - dy;
+	// Clip once to the tile and the screen:
+	int x1 = std::max(srcx1 - std::min(dx, 0), 0);
+	int x2 = std::min(std::min(srcx2, 256 - dx), 8);
+	int y1 = std::max(srcy1 - std::min(dy, 0), 0);
+	int y2 = std::min(std::min(srcy2, 240 - dy), 8);
+	if(x1 >= x2 || y1 >= y2) {
+		return;
 	}
 
-	if(!flipHorizontal && !flipVertical) {
-
-		fbIndex = (dy << 8) + dx;
-		tIndex = 0;
-		for(y = 0; y < 8; ++y) {
-			for(x = 0; x < 8; ++x) {
-				if(x >= srcx1 && x < srcx2 && y >= srcy1 && y < srcy2) {
-					palIndex = pix[tIndex];
-					tpri = (*priTable)[fbIndex];
-					if(palIndex != 0 && pri <= (tpri & 0xFF)) {
-						(*fBuffer)[fbIndex] = (*palette)[palIndex + palAdd];
-						tpri = (tpri & 0xF00) | pri;
-						(*priTable)[fbIndex] = tpri;
-					}
-				}
-				++fbIndex;
-				++tIndex;
-			}
-			fbIndex -= 8;
-			fbIndex += 256;
+	for(int row = y1; row < y2; ++row) {
+		const uint8_t* src = &pix[(flipVertical ? 7 - row : row) << 3];
+		uint8_t* dest = &(*fBuffer)[((dy + row) << 8) + dx];
+		uint8_t* dpri = &(*priTable)[((dy + row) << 8) + dx];
+		if(x1 == 0 && x2 == 8) {
+			renderRow(src, dest, dpri, palAdd, palette, flipHorizontal, pri);
+			continue;
 		}
 
-	} else if(flipHorizontal && !flipVertical) {
-
-		fbIndex = (dy << 8) + dx;
-		tIndex = 7;
-		for(y = 0; y < 8; ++y) {
-			for(x = 0; x < 8; ++x) {
-				if(x >= srcx1 && x < srcx2 && y >= srcy1 && y < srcy2) {
-					palIndex = pix[tIndex];
-					tpri = (*priTable)[fbIndex];
-					if(palIndex != 0 && pri <= (tpri & 0xFF)) {
-						(*fBuffer)[fbIndex] = (*palette)[palIndex + palAdd];
-						tpri = (tpri & 0xF00) | pri;
-						(*priTable)[fbIndex] = tpri;
-					}
-				}
-				++fbIndex;
-				--tIndex;
+		// Partly clipped rows:
+		for(int col = x1; col < x2; ++col) {
+			int index = src[flipHorizontal ? 7 - col : col];
+			if(index != 0 && pri <= (dpri[col] & 0x7F)) {
+				dest[col] = (*palette)[index + palAdd];
+				dpri[col] = (dpri[col] & 0x80) | pri;
 			}
-			fbIndex -= 8;
-			fbIndex += 256;
-			tIndex += 16;
 		}
+	}
+}
 
-	} else if(flipVertical && !flipHorizontal) {
-
-		fbIndex = (dy << 8) + dx;
-		tIndex = 56;
-		for(y = 0; y < 8; ++y) {
-			for(x = 0; x < 8; ++x) {
-				if(x >= srcx1 && x < srcx2 && y >= srcy1 && y < srcy2) {
-					palIndex = pix[tIndex];
-					tpri = (*priTable)[fbIndex];
-					if(palIndex != 0 && pri <= (tpri & 0xFF)) {
-						(*fBuffer)[fbIndex] = (*palette)[palIndex + palAdd];
-						tpri = (tpri & 0xF00) | pri;
-						(*priTable)[fbIndex] = tpri;
-					}
-				}
-				++fbIndex;
-				++tIndex;
-			}
-			fbIndex -= 8;
-			fbIndex += 256;
-			tIndex -= 16;
-		}
+// Draws a whole row of 8 pixels where no pixel of a sprite with a lower
+// number is already drawn. Transparent pixels are skipped:
+void Tile::renderRow(const uint8_t* src, uint8_t* dest, uint8_t* dpri, int palAdd, array<uint8_t, 16>* palette, bool flipHorizontal, int pri) {
+#ifdef __SSE2__
+	__m128i index = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src));
+	if(flipHorizontal) {
+		// Reverse the 8 pixels as 16 bit values:
+		index = _mm_unpacklo_epi8(index, _mm_setzero_si128());
+		index = _mm_shufflelo_epi16(index, _MM_SHUFFLE(0, 1, 2, 3));
+		index = _mm_shufflehi_epi16(index, _MM_SHUFFLE(0, 1, 2, 3));
+		index = _mm_shuffle_epi32(index, _MM_SHUFFLE(1, 0, 3, 2));
+		index = _mm_packus_epi16(index, index);
+	}
 
-	} else {
-
-		fbIndex = (dy << 8) + dx;
-		tIndex = 63;
-		for(y = 0; y < 8; ++y) {
-			for(x = 0; x < 8; ++x) {
-				if(x >= srcx1 && x < srcx2 && y >= srcy1 && y < srcy2) {
-					palIndex = pix[tIndex];
-					tpri = (*priTable)[fbIndex];
-					if(palIndex != 0 && pri <= (tpri & 0xFF)) {
-						(*fBuffer)[fbIndex] = (*palette)[palIndex + palAdd];
-						tpri = (tpri & 0xF00) | pri;
-						(*priTable)[fbIndex] = tpri;
-					}
-				}
-				++fbIndex;
-				--tIndex;
-			}
-			fbIndex -= 8;
-			fbIndex += 256;
+	__m128i* out = reinterpret_cast<__m128i*>(dest);
+	__m128i* outPri = reinterpret_cast<__m128i*>(dpri);
+	__m128i oldPri = _mm_loadl_epi64(outPri);
+	const __m128i priority = _mm_set1_epi8(static_cast<char>(pri));
+	const __m128i sprite_bits = _mm_set1_epi8(0x7F);
+
+	// Draw where the pixel is not transparent, and no lower sprite is there:
+	__m128i hidden = _mm_or_si128(
+		_mm_cmpeq_epi8(index, _mm_setzero_si128()),
+		_mm_cmpgt_epi8(priority, _mm_and_si128(oldPri, sprite_bits)));
+
+	__m128i color = _mm_and_si128(_mm_cmpeq_epi8(index, _mm_set1_epi8(1)), _mm_set1_epi8((*palette)[palAdd + 1]));
+	color = _mm_or_si128(color, _mm_and_si128(_mm_cmpeq_epi8(index, _mm_set1_epi8(2)), _mm_set1_epi8((*palette)[palAdd + 2])));
+	color = _mm_or_si128(color, _mm_and_si128(_mm_cmpeq_epi8(index, _mm_set1_epi8(3)), _mm_set1_epi8((*palette)[palAdd + 3])));
+	_mm_storel_epi64(out, _mm_or_si128(_mm_and_si128(hidden, _mm_loadl_epi64(out)), _mm_andnot_si128(hidden, color)));
+
+	__m128i newPri = _mm_or_si128(_mm_andnot_si128(sprite_bits, oldPri), priority);
+	_mm_storel_epi64(outPri, _mm_or_si128(_mm_and_si128(hidden, oldPri), _mm_andnot_si128(hidden, newPri)));
+#else
+	for(int col = 0; col < 8; ++col) {
+		int index = src[flipHorizontal ? 7 - col : col];
+		if(index != 0 && pri <= (dpri[col] & 0x7F)) {
+			dest[col] = (*palette)[palAdd + index];
+			dpri[col] = (dpri[col] & 0x80) | pri;
 		}
-
 	}
+#endif
 }
 
 bool Tile::isTransparent(int x, int y) {
@@ -242,4 +206,12 @@ void Tile::stateLoad(ByteBuffer* buf) {
 	for(int i = 0; i < 64; ++i) {
 		pix[i] = buf->readByte();
 	}
+	for(int i = 0; i < 8; ++i) {
+		rowMask[i] = 0;
+		for(int j = 0; j < 8; ++j) {
+			if(pix[(i << 3) + j] != 0) {
+				rowMask[i] |= 0x80 >> j;
+			}
+		}
+	}
 }
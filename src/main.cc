@@ -6,6 +6,14 @@ Hosted at: https://github.com/workhorsy/SaltyNES
 */
 
 #include "SaltyNES.h"
+#include <climits>
+
+#ifdef DESKTOP
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
 
 std::string get_build_date();
 
@@ -13,7 +21,17 @@ using namespace std;
 
 SaltyNES salty_nes;
 vector<uint8_t> g_game_data;
+const uint8_t* g_game_mapping = nullptr;
+size_t g_game_mapping_size = 0;
 string g_game_file_name;
+#ifdef ALLOC_CHECK
+	int g_alloc_check_frames = 600;
+#else
+	int g_alloc_check_frames = 0;
+#endif
+bool g_is_present_threaded = false;
+bool g_is_resume_on = false;
+uint64_t g_start_ticks = 0;
 
 void set_is_windows() {
 	Globals::is_windows = true;
@@ -27,13 +45,34 @@ bool toggle_sound() {
 
 void on_emultor_start() {
 	salty_nes.init();
-	salty_nes.load_rom(g_game_file_name, &g_game_data, nullptr);
+	#ifdef DESKTOP
+		salty_nes.load_rom(g_game_file_name, g_game_mapping, g_game_mapping_size, nullptr);
+
+		// Continue from the snapshot, instead of booting the game. If the
+		// snapshot is bad, boot the game from the rom again
+		if (g_is_resume_on && salty_nes.nes->getRom()->isValid() && Snapshot::exists(salty_nes.nes)) {
+			if (! Snapshot::load(salty_nes.nes)) {
+				fprintf(stderr, "Booting the game instead\n");
+				salty_nes.load_rom(g_game_file_name, g_game_mapping, g_game_mapping_size, nullptr);
+			}
+		}
+
+		// The ROM copies the banks it needs, so the file can be unmapped after
+		munmap(const_cast<uint8_t*>(g_game_mapping), g_game_mapping_size);
+		g_game_mapping = nullptr;
+		g_game_mapping_size = 0;
+	#endif
+	#ifdef WEB
+		salty_nes.load_rom(g_game_file_name, g_game_data.data(), g_game_data.size(), nullptr);
+	#endif
 	salty_nes.run();
 }
 
 void on_emultor_loop() {
 	if (salty_nes.nes) {
+		ChromeTrace::begin("frame");
 		salty_nes.nes->getCpu()->emulate_frame();
+		ChromeTrace::end("frame");
 
 		if (salty_nes.nes->getCpu()->stopRunning) {
 			#ifdef WEB
@@ -45,8 +84,45 @@ void on_emultor_loop() {
 
 void start_main_loop() {
 	#ifdef DESKTOP
+		int frames = 0;
+		bool is_first_frame = true;
 		while (! salty_nes.nes->getCpu()->stopRunning) {
 			on_emultor_loop();
+
+			// Time from starting, to the first frame being emulated
+			if (is_first_frame && (g_is_resume_on || FrameTiming::_print_report)) {
+				double ms = (SDL_GetPerformanceCounter() - g_start_ticks) * 1000.0 / SDL_GetPerformanceFrequency();
+				printf("time_to_first_frame: %.2f ms\n", ms);
+				is_first_frame = false;
+			}
+
+			// Snapshots are only taken between frames
+			if (salty_nes.nes->_is_snapshot_wanted) {
+				Snapshot::save(salty_nes.nes);
+				salty_nes.nes->_is_snapshot_wanted = false;
+			}
+
+			// Count allocations after the first frame, then stop:
+			if (g_alloc_check_frames > 0) {
+				++frames;
+				if (frames == 1) {
+					AllocCounter::start();
+				} else if (frames == g_alloc_check_frames + 1) {
+					AllocCounter::stop();
+
+					// Save the state like a snapshot does, which must not
+					// stop the game
+					ByteBuffer buf(0x40000, ByteBuffer::BO_BIG_ENDIAN);
+					salty_nes.nes->stateSave(&buf);
+				} else if (frames > g_alloc_check_frames + 60) {
+					break;
+				}
+			}
+		}
+
+		// Suspend the game, to resume it next time
+		if (g_is_resume_on && ! salty_nes.nes->getCpu()->crash) {
+			Snapshot::save(salty_nes.nes);
 		}
 	#endif
 
@@ -59,8 +135,15 @@ void start_main_loop() {
 		emscripten_set_main_loop(on_emultor_loop, 0, true);
 	#endif
 
-	// Cleanup the SDL resources then exit
+	// Stop drawing frames, then cleanup the SDL resources and exit
+	if (salty_nes.nes) {
+		salty_nes.nes->getPpu()->stopPipeline();
+	}
+	Presenter::close();
 	SDL_Quit();
+
+	// Every thread that records trace events is stopped now
+	ChromeTrace::close();
 }
 
 void set_game_data_size(size_t size) {
@@ -72,23 +155,68 @@ void set_game_data_index(size_t index, uint8_t data) {
 	g_game_data[index] = data;
 }
 
+#ifdef DESKTOP
+
+// Maps the rom file read only, instead of reading it into a buffer:
 void set_game_data_from_file(string file_name) {
-	ifstream reader(file_name.c_str(), ios::in|ios::binary);
-	if(reader.fail()) {
+	int fd = open(file_name.c_str(), O_RDONLY);
+	struct stat info;
+	if(fd == -1 || fstat(fd, &info) == -1) {
+		fprintf(stderr, "Error while loading rom '%s': %s\n", file_name.c_str(), strerror(errno));
+		exit(1);
+	}
+	if(info.st_size <= 0) {
+		fprintf(stderr, "Error while loading rom '%s': %s\n", file_name.c_str(), "File is empty");
+		exit(1);
+	}
+
+	size_t length = static_cast<size_t>(info.st_size);
+	void* mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(mapping == MAP_FAILED) {
 		fprintf(stderr, "Error while loading rom '%s': %s\n", file_name.c_str(), strerror(errno));
 		exit(1);
 	}
 
-	reader.seekg(0, ios::end);
-	size_t length = reader.tellg();
-	reader.seekg(0, ios::beg);
-	assert(length > 0);
-	g_game_data.resize(length);
-	reader.read(reinterpret_cast<char*>(g_game_data.data()), g_game_data.size());
-	reader.close();
+	g_game_mapping = static_cast<const uint8_t*>(mapping);
+	g_game_mapping_size = length;
 	g_game_file_name = file_name;
 }
 
+#endif
+
+// Prints how fast sha256 is with the portable code and with the CPU's SHA
+// instructions, and fails if they give different hashes:
+int bench_sha256() {
+	vector<uint8_t> data(64 * 1024 * 1024);
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = static_cast<uint8_t>((i * 2654435761u) >> 24);
+	}
+
+	array<uint8_t, SHA256_HASH_SIZE> hashes[2];
+	for (int use_scalar = 1; use_scalar >= 0; --use_scalar) {
+		SHA256UseScalar(use_scalar);
+
+		// Hash it in pieces, like a rom being decoded
+		uint64_t start = SDL_GetPerformanceCounter();
+		SHA256Context ctx;
+		SHA256Init(&ctx);
+		for (size_t i = 0; i < data.size(); i += 32768) {
+			SHA256Update(&ctx, &data[i], 32768);
+		}
+		SHA256Final(&ctx, hashes[use_scalar].data());
+		double seconds = static_cast<double>(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+		printf("sha256 %s: %.1f MB/s\n", SHA256Implementation(), data.size() / seconds / (1024 * 1024));
+	}
+	SHA256UseScalar(0);
+
+	if (hashes[0] != hashes[1]) {
+		fprintf(stderr, "The sha256 hashes do not match\n");
+		return -1;
+	}
+	return 0;
+}
+
 #ifdef WEB
 
 EMSCRIPTEN_BINDINGS(Wrappers) {
@@ -102,6 +230,60 @@ EMSCRIPTEN_BINDINGS(Wrappers) {
 #endif
 
 int main(int argc, char* argv[]) {
+	g_start_ticks = SDL_GetPerformanceCounter();
+
+	// Read the command line options
+	#ifdef DESKTOP
+		string rom_file;
+		for (int i = 1; i < argc; ++i) {
+			string arg = argv[i];
+			if (arg == "--trace") {
+				Globals::enableCpuTrace = true;
+			} else if (arg == "--profile") {
+				Globals::cpuProfileFrames = 60;
+			} else if (arg == "--profile-frames") {
+				Globals::cpuProfileFrames = 1;
+			} else if (arg == "--timing") {
+				FrameTiming::init(true);
+			} else if (arg == "--chrome-trace" && i + 1 < argc) {
+				if (! ChromeTrace::init(argv[++i])) {
+					return -1;
+				}
+				ChromeTrace::name_thread("emulation");
+			} else if (arg == "--present-threaded") {
+				g_is_present_threaded = true;
+			} else if (arg == "--pipelined") {
+				Globals::pipelinedRendering = true;
+			} else if (arg == "--frameskip" && i + 1 < argc) {
+				char* end = nullptr;
+				long value = strtol(argv[++i], &end, 10);
+				if (*argv[i] == '\0' || *end != '\0' || value < 1 || value > INT_MAX) {
+					fprintf(stderr, "The frameskip must be a positive number, but got '%s'\n", argv[i]);
+					return -1;
+				}
+				Globals::frameSkip = static_cast<int>(value);
+			} else if (arg == "--resume") {
+				g_is_resume_on = true;
+			} else if (arg == "--skip-same-frames") {
+				Globals::skipSameFrames = true;
+			} else if (arg == "--format-trace" && i + 1 < argc) {
+				return CpuTrace::format(argv[++i], stdout) ? 0 : -1;
+			} else if (arg == "--bench-sha256") {
+				return bench_sha256();
+			} else if (arg == "--index" && i + 1 < argc) {
+				return RomIndex::index(argv[++i]) ? 0 : -1;
+			} else if (arg.size() > 1 && arg[0] == '-') {
+				fprintf(stderr, "Unknown option, or it is missing its value: '%s'\n", arg.c_str());
+				return -1;
+			} else if (rom_file.empty()) {
+				rom_file = arg;
+			} else {
+				fprintf(stderr, "Only one rom file can be given, but got '%s' and '%s'\n", rom_file.c_str(), arg.c_str());
+				return -1;
+			}
+		}
+	#endif
+
 	printf("%s\n", "SaltyNES is a NES emulator in WebAssembly");
 	printf("%s\n", "SaltyNES (C) 2012-2017 Matthew Brennan Jones <matthew.brennan.jones@gmail.com>");
 	printf("%s\n", "vNES 2.14 (C) 2006-2011 Jamie Sanders thatsanderskid.com");
@@ -111,16 +293,37 @@ int main(int argc, char* argv[]) {
 
 	// Make sure there is a rom file name
 	#ifdef DESKTOP
-		if (argc < 2) {
+		if (rom_file.empty()) {
 			fprintf(stderr, "No rom file argument provided. Exiting ...\n");
 			return -1;
 		}
-		set_game_data_from_file(argv[1]);
+		set_game_data_from_file(rom_file);
 	#endif
 	#ifdef WEB
 		g_game_file_name = "rom_from_browser.nes";
 	#endif
 
+	#ifdef ALLOC_CHECK
+		// Run without a window, and with sound that goes nowhere
+		SDL_setenv("SDL_AUDIODRIVER", "dummy", 1);
+		if (SDL_Init(SDL_INIT_AUDIO) != 0) {
+			fprintf(stderr, "Could not initialize SDL: %s\n", SDL_GetError());
+			return -1;
+		}
+		Presenter::init_headless();
+		on_emultor_start();
+		start_main_loop();
+
+		// Fail if any frame after the first allocated, or the game stopped
+		// after the state was saved:
+		printf("Heap allocations in %d frames after the first: %zu\n", g_alloc_check_frames, AllocCounter::count());
+		if (salty_nes.nes->getCpu()->stopRunning) {
+			fprintf(stderr, "The game stopped after its state was saved\n");
+			return 1;
+		}
+		return AllocCounter::count() == 0 ? 0 : 1;
+	#endif
+
 	// Initialize SDL
 	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_JOYSTICK) != 0) {
 		fprintf(stderr, "Could not initialize SDL: %s\n", SDL_GetError());
@@ -138,22 +341,11 @@ int main(int argc, char* argv[]) {
 		return -1;
 	}
 
-	// Create a SDL renderer
-	Globals::g_renderer = SDL_CreateRenderer(
-		Globals::g_window,
-		-1,
-		SDL_RENDERER_ACCELERATED
-	);
-	if (! Globals::g_renderer) {
-		fprintf(stderr, "Couldn't create a renderer: %s\n", SDL_GetError());
-		return -1;
-	}
-
-	// Create the SDL screen
-	Globals::g_screen = SDL_CreateTexture(Globals::g_renderer,
-			SDL_PIXELFORMAT_BGR888, SDL_TEXTUREACCESS_STATIC, 256, 240);
-	if (! Globals::g_screen) {
-		fprintf(stderr, "Couldn't create a teture: %s\n", SDL_GetError());
+	// Create the SDL renderer and screen
+	#ifdef WEB
+		g_is_present_threaded = false;
+	#endif
+	if (! Presenter::init(g_is_present_threaded)) {
 		return -1;
 	}
 
@@ -32,6 +32,17 @@
 #include <string.h>
 #include "sha256sum.h"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#define SHA256_ARM 1
+#include <arm_neon.h>
+#endif
+
 #define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
 #define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
 
@@ -384,10 +395,176 @@ static void SHA256Guts(SHA256Context * sc, const uint32_t * cbuf)
         sc->hash[7] += h;
 }
 
+static void SHA256BlocksScalar(SHA256Context * sc, const uint8_t * data, uint32_t count)
+{
+        while(count--) {
+                SHA256Guts(sc, reinterpret_cast<const uint32_t*>(data));
+                data += 64L;
+        }
+}
+
+#ifdef SHA256_X86
+
+/*
+ * Uses the SHA-NI instructions. The state is kept as ABEF and CDGH, which is
+ * the order sha256rnds2 wants it in. Each group of 4 rounds makes the next 4
+ * message words with sha256msg1 and sha256msg2.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void SHA256BlocksX86(SHA256Context * sc, const uint8_t * data, uint32_t count)
+{
+        const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+        __m128i state0, state1, tmp, k, abef, cdgh;
+        __m128i msg[4];
+        int i;
+
+        tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&sc->hash[0]));
+        state1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&sc->hash[4]));
+        tmp = _mm_shuffle_epi32(tmp, 0xB1);
+        state1 = _mm_shuffle_epi32(state1, 0x1B);
+        state0 = _mm_alignr_epi8(tmp, state1, 8);
+        state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+        while(count--) {
+                abef = state0;
+                cdgh = state1;
+
+                for(i = 0; i < 16; i++) {
+                        if(i < 4) {
+                                tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i * 16));
+                                msg[i] = _mm_shuffle_epi8(tmp, MASK);
+                        } else {
+                                tmp = _mm_sha256msg1_epu32(msg[i & 3], msg[(i - 3) & 3]);
+                                tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(msg[(i - 1) & 3], msg[(i - 2) & 3], 4));
+                                msg[i & 3] = _mm_sha256msg2_epu32(tmp, msg[(i - 1) & 3]);
+                        }
+
+                        k = _mm_add_epi32(msg[i & 3], _mm_loadu_si128(reinterpret_cast<const __m128i*>(&K[i * 4])));
+                        state1 = _mm_sha256rnds2_epu32(state1, state0, k);
+                        state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(k, 0x0E));
+                }
+
+                state0 = _mm_add_epi32(state0, abef);
+                state1 = _mm_add_epi32(state1, cdgh);
+                data += 64L;
+        }
+
+        tmp = _mm_shuffle_epi32(state0, 0x1B);
+        state1 = _mm_shuffle_epi32(state1, 0xB1);
+        state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+        state1 = _mm_alignr_epi8(state1, tmp, 8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&sc->hash[0]), state0);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&sc->hash[4]), state1);
+}
+
+static int hasShaInstructions(void)
+{
+        unsigned int eax, ebx, ecx, edx;
+
+        if(__get_cpuid_max(0, 0) < 7)
+                return 0;
+        __cpuid(1, eax, ebx, ecx, edx);
+        if(!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+                return 0;
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        return (ebx & (1 << 29)) != 0;
+}
+
+#endif                          /* SHA256_X86 */
+
+#ifdef SHA256_ARM
+
+/*
+ * Uses the ARMv8 crypto extension. These are only built in when the compiler
+ * targets a CPU that has them, so they are always used then.
+ */
+static void SHA256BlocksArm(SHA256Context * sc, const uint8_t * data, uint32_t count)
+{
+        uint32x4_t state0, state1, abcd, efgh, tmp, k;
+        uint32x4_t msg[4];
+        int i;
+
+        state0 = vld1q_u32(&sc->hash[0]);
+        state1 = vld1q_u32(&sc->hash[4]);
+
+        while(count--) {
+                abcd = state0;
+                efgh = state1;
+
+                for(i = 0; i < 16; i++) {
+                        if(i < 4) {
+                                msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+                        } else {
+                                msg[i & 3] = vsha256su1q_u32(vsha256su0q_u32(msg[i & 3], msg[(i - 3) & 3]),
+                                                             msg[(i - 2) & 3], msg[(i - 1) & 3]);
+                        }
+
+                        k = vaddq_u32(msg[i & 3], vld1q_u32(&K[i * 4]));
+                        tmp = state0;
+                        state0 = vsha256hq_u32(state0, state1, k);
+                        state1 = vsha256h2q_u32(state1, tmp, k);
+                }
+
+                state0 = vaddq_u32(state0, abcd);
+                state1 = vaddq_u32(state1, efgh);
+                data += 64L;
+        }
+
+        vst1q_u32(&sc->hash[0], state0);
+        vst1q_u32(&sc->hash[4], state1);
+}
+
+#endif                          /* SHA256_ARM */
+
+typedef void (*SHA256BlocksFunction)(SHA256Context * sc, const uint8_t * data, uint32_t count);
+
+static int useScalar = 0;
+
+/* Picks the fastest block function the CPU has, once */
+static SHA256BlocksFunction SHA256FastestBlocks(void)
+{
+#if defined(SHA256_X86)
+        if(hasShaInstructions())
+                return SHA256BlocksX86;
+#elif defined(SHA256_ARM)
+        return SHA256BlocksArm;
+#endif
+        return SHA256BlocksScalar;
+}
+
+static SHA256BlocksFunction SHA256Blocks(void)
+{
+        static const SHA256BlocksFunction fastest = SHA256FastestBlocks();
+
+        return useScalar ? SHA256BlocksScalar : fastest;
+}
+
+const char *SHA256Implementation(void)
+{
+        SHA256BlocksFunction blocks = SHA256Blocks();
+
+#ifdef SHA256_X86
+        if(blocks == SHA256BlocksX86)
+                return "sha-ni";
+#endif
+#ifdef SHA256_ARM
+        if(blocks == SHA256BlocksArm)
+                return "armv8";
+#endif
+        return "scalar";
+}
+
+void SHA256UseScalar(int on)
+{
+        useScalar = on;
+}
+
 void SHA256Update(SHA256Context * sc, const void *data, uint32_t len)
 {
+        SHA256BlocksFunction blocks = SHA256Blocks();
         uint32_t bufferBytesLeft;
         uint32_t bytesToCopy;
+        uint32_t count;
         int needBurn = 0;
 
         if(sc->bufferLength) {
@@ -406,20 +583,22 @@ void SHA256Update(SHA256Context * sc, const void *data, uint32_t len)
                 len -= bytesToCopy;
 
                 if(sc->bufferLength == 64L) {
-                        SHA256Guts(sc, sc->buffer.words);
+                        blocks(sc, sc->buffer.bytes, 1);
                         needBurn = 1;
                         sc->bufferLength = 0L;
                 }
         }
 
-        while(len > 63L) {
-                sc->totalLength += 512L;
+        /* Hash all the whole blocks in one call */
+        if(len > 63L) {
+                count = len / 64L;
+                sc->totalLength += count * 512ULL;
 
-                SHA256Guts(sc, reinterpret_cast<const uint32_t*>(data));
+                blocks(sc, reinterpret_cast<const uint8_t *>(data), count);
                 needBurn = 1;
 
-                data = reinterpret_cast<const uint8_t *>(data) + 64L;
-                len -= 64L;
+                data = reinterpret_cast<const uint8_t *>(data) + count * 64L;
+                len -= count * 64L;
         }
 
         if(len) {
@@ -430,7 +609,7 @@ void SHA256Update(SHA256Context * sc, const void *data, uint32_t len)
                 sc->bufferLength += len;
         }
 
-        if(needBurn)
+        if(needBurn && blocks == SHA256BlocksScalar)
                 burnStack(sizeof(uint32_t[74]) + sizeof(uint32_t *[6]) +
                           sizeof(int));
 }
@@ -52,6 +52,13 @@ extern "C" {
 
         void SHA256Final(SHA256Context * sc, uint8_t hash[SHA256_HASH_SIZE]);
 
+        /* Returns which code hashes blocks: "sha-ni", "armv8" or "scalar" */
+        const char *SHA256Implementation(void);
+
+        /* Makes the portable code be used even if the CPU has SHA
+           instructions, to compare them. Not safe while hashing. */
+        void SHA256UseScalar(int on);
+
 #ifdef __cplusplus
 }
 #endif